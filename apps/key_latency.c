@@ -0,0 +1,250 @@
+/*
+ * Interrupt to user space latency report for the lab 7.2 int_key_wait
+ * driver.
+ *
+ * Blocks in read() on the key device and, for every record returned,
+ * takes CLOCK_MONOTONIC right after the read and subtracts the timestamp
+ * the driver took in its interrupt handler. That is the latency user space
+ * actually sees: interrupt entry, queueing, wakeup, scheduling and the
+ * copy out. The result is printed as a log2 histogram with percentiles,
+ * next to the driver's own histogram from debugfs, which stops the clock
+ * when the record is dequeued and so leaves out the return to user space.
+ * Comparing the two across IRQ threading and CPU isolation settings shows
+ * where the time goes.
+ *
+ * With a debounce window set on the device, records are stamped with the
+ * first edge of a burst, so every latency includes the window; write 0 to
+ * /sys/class/misc/mydev/debounce_us to measure the bare path.
+ *
+ * Build: gcc -O2 -Wall -o key_latency key_latency.c
+ * Usage: key_latency [-d dev] [-k debugfs file] [-n events] [-r]
+ * -r clears the driver's histogram before the first event.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "../labs/lab_7_2/int_key_wait.h"
+
+#define BUCKETS 32
+#define READ_MAX 64
+
+static const char *dev_path = "/dev/mydev";
+static const char *lat_path =
+	"/sys/kernel/debug/intkeywait-soc:int_key/latency";
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* Same bucketing as the driver: bucket n is [2^n, 2^(n+1)) ns */
+static unsigned int bucket_of(uint64_t ns)
+{
+	unsigned int b = 0;
+
+	while (ns >>= 1)
+		b++;
+	return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+static uint64_t bucket_low(unsigned int b)
+{
+	return b ? 1ull << b : 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *lat, size_t n, double p)
+{
+	size_t idx;
+
+	if (!n)
+		return 0;
+	idx = (size_t)(p * n);
+	if (idx >= n)
+		idx = n - 1;
+	return lat[idx] / 1000.0;
+}
+
+static void print_histogram(const char *title, const uint64_t *hist)
+{
+	uint64_t total = 0, max = 0;
+	unsigned int b, first = BUCKETS, last = 0;
+	int bar;
+
+	for (b = 0; b < BUCKETS; b++) {
+		total += hist[b];
+		if (hist[b] > max)
+			max = hist[b];
+		if (hist[b]) {
+			if (first == BUCKETS)
+				first = b;
+			last = b;
+		}
+	}
+
+	printf("%s, %llu events\n", title, (unsigned long long)total);
+	if (!total)
+		return;
+
+	printf("%12s %12s %10s\n", ">= us", "< us", "events");
+	for (b = first; b <= last; b++) {
+		bar = (int)(hist[b] * 40 / max);
+		printf("%12.3f %12.3f %10llu |%.*s\n", bucket_low(b) / 1000.0,
+		       (1ull << (b + 1)) / 1000.0,
+		       (unsigned long long)hist[b], bar,
+		       "########################################");
+	}
+}
+
+/* Parse the driver's "<lower bound> <count>" lines, -1 if unavailable */
+static int read_kernel_histogram(uint64_t *hist)
+{
+	unsigned long long low, count;
+	FILE *f;
+
+	f = fopen(lat_path, "r");
+	if (!f)
+		return -1;
+
+	memset(hist, 0, BUCKETS * sizeof(*hist));
+	while (fscanf(f, "%llu %llu", &low, &count) == 2)
+		hist[bucket_of(low)] += count;
+
+	fclose(f);
+	return 0;
+}
+
+static int reset_kernel_histogram(void)
+{
+	int fd, ret;
+
+	fd = open(lat_path, O_WRONLY);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, "0", 1) == 1 ? 0 : -1;
+	close(fd);
+	return ret;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-k debugfs file] [-n events] [-r]\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct key_event ev[READ_MAX];
+	uint64_t hist[BUCKETS] = { 0 };
+	uint64_t khist[BUCKETS];
+	unsigned int events = 100;
+	unsigned int lost = 0;
+	uint32_t next_seq = 0;
+	int have_seq = 0;
+	int reset = 0;
+	uint64_t *lat, now;
+	size_t n = 0, i, nr;
+	ssize_t len;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "d:k:n:rh")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_path = optarg;
+			break;
+		case 'k':
+			lat_path = optarg;
+			break;
+		case 'n':
+			events = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			reset = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!events)
+		usage(argv[0]);
+
+	lat = calloc(events, sizeof(*lat));
+	if (!lat)
+		return EXIT_FAILURE;
+
+	fd = open(dev_path, O_RDONLY);
+	if (fd < 0) {
+		perror(dev_path);
+		return EXIT_FAILURE;
+	}
+
+	if (reset && reset_kernel_histogram())
+		fprintf(stderr, "%s: %s, driver histogram not cleared\n",
+			lat_path, strerror(errno));
+
+	fprintf(stderr, "waiting for %u key events on %s\n", events,
+		dev_path);
+
+	while (n < events) {
+		len = read(fd, ev, sizeof(ev));
+		now = now_ns();
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			break;
+		}
+
+		nr = len / sizeof(ev[0]);
+		for (i = 0; i < nr && n < events; i++) {
+			/* seq counts dropped events too */
+			if (have_seq)
+				lost += ev[i].seq - next_seq;
+			next_seq = ev[i].seq + 1;
+			have_seq = 1;
+
+			lat[n] = now - ev[i].timestamp_ns;
+			hist[bucket_of(lat[n])]++;
+			n++;
+		}
+	}
+
+	close(fd);
+
+	qsort(lat, n, sizeof(*lat), cmp_u64);
+
+	print_histogram("user wakeup latency", hist);
+	if (n)
+		printf("p50 %.2f us, p99 %.2f us, max %.2f us, %u lost\n",
+		       percentile_us(lat, n, 0.50), percentile_us(lat, n, 0.99),
+		       lat[n - 1] / 1000.0, lost);
+
+	printf("\n");
+	if (read_kernel_histogram(khist))
+		fprintf(stderr, "%s: %s, no driver histogram\n", lat_path,
+			strerror(errno));
+	else
+		print_histogram("driver dequeue latency", khist);
+
+	free(lat);
+
+	return n == events ? 0 : EXIT_FAILURE;
+}
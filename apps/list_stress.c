@@ -0,0 +1,249 @@
+/*
+ * Stress test for the lab 8.1 linkedlist_platform ring.
+ *
+ * A writer thread and a reader thread stream through /dev/mydev at the
+ * same time, each with its own file and random request sizes, which is
+ * the single producer/single consumer pairing the ring is built for.
+ * Every byte written is a function of its position in the stream, so the
+ * reader catches any byte that is lost, duplicated, reordered or torn and
+ * reports the first offset that does not match. The throughput of the
+ * run is printed at the end.
+ *
+ * With -p both sides open the device O_NONBLOCK and wait in poll()
+ * instead of sleeping in read() and write(), which exercises the wakeups
+ * and EAGAIN paths as well. The ring has to be in its default, non
+ * broadcast mode.
+ *
+ * Build: gcc -O2 -Wall -o list_stress list_stress.c -lpthread
+ * Usage: list_stress [-d dev] [-b bytes] [-s max request] [-p]
+ * Sizes take a K, M or G suffix.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+
+struct side {
+	pthread_t thread;
+	int fd;
+	uint64_t done;
+	unsigned int seed;
+	int error;
+};
+
+static const char *dev_path = "/dev/mydev";
+static uint64_t total = 1ull << 30;
+static size_t max_req = 64 << 10;
+static int use_poll;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/* The byte at stream offset pos, no two nearby offsets alike */
+static unsigned char pattern(uint64_t pos)
+{
+	uint64_t x = pos * 0x9e3779b97f4a7c15ull;
+
+	return (unsigned char)(x >> 56);
+}
+
+/* 1 to max_req bytes, biased towards small requests */
+static size_t request_size(struct side *s)
+{
+	size_t max = max_req;
+
+	if (rand_r(&s->seed) & 1)
+		max = max > 64 ? 64 : max;
+	return 1 + rand_r(&s->seed) % max;
+}
+
+/* 0 to go on, -1 on error */
+static int wait_ready(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+
+	if (!use_poll)
+		return 0;
+	while (poll(&pfd, 1, -1) < 0)
+		if (errno != EINTR)
+			return -1;
+	return 0;
+}
+
+static void *writer_main(void *arg)
+{
+	struct side *s = arg;
+	unsigned char *buf;
+	size_t len, i;
+	ssize_t ret;
+
+	buf = malloc(max_req);
+	if (!buf) {
+		s->error = ENOMEM;
+		return NULL;
+	}
+
+	while (s->done < total) {
+		len = request_size(s);
+		if (len > total - s->done)
+			len = total - s->done;
+		for (i = 0; i < len; i++)
+			buf[i] = pattern(s->done + i);
+
+		ret = write(s->fd, buf, len);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && !wait_ready(s->fd, POLLOUT))
+				continue;
+			s->error = errno;
+			break;
+		}
+		/* a short write leaves the rest for the next request */
+		s->done += ret;
+	}
+
+	free(buf);
+	return NULL;
+}
+
+static void *reader_main(void *arg)
+{
+	struct side *s = arg;
+	unsigned char *buf;
+	ssize_t ret, i;
+
+	buf = malloc(max_req);
+	if (!buf) {
+		s->error = ENOMEM;
+		return NULL;
+	}
+
+	while (s->done < total) {
+		ret = read(s->fd, buf, request_size(s));
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN && !wait_ready(s->fd, POLLIN))
+				continue;
+			s->error = errno;
+			break;
+		}
+		for (i = 0; i < ret; i++) {
+			if (buf[i] != pattern(s->done + i)) {
+				fprintf(stderr,
+					"mismatch at offset %llu: got 0x%02x, "
+					"expected 0x%02x\n",
+					(unsigned long long)(s->done + i),
+					buf[i], pattern(s->done + i));
+				s->error = EILSEQ;
+				goto out;
+			}
+		}
+		s->done += ret;
+	}
+
+out:
+	free(buf);
+	return NULL;
+}
+
+static uint64_t parse_size(const char *s)
+{
+	char *end;
+	uint64_t v = strtoull(s, &end, 0);
+
+	if (*end == 'K' || *end == 'k')
+		v <<= 10;
+	else if (*end == 'M' || *end == 'm')
+		v <<= 20;
+	else if (*end == 'G' || *end == 'g')
+		v <<= 30;
+	return v;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-b bytes] [-s max request] [-p]\n",
+		prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	struct side writer = { .seed = 1 }, reader = { .seed = 2 };
+	int flags = 0;
+	uint64_t start, elapsed;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:b:s:ph")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_path = optarg;
+			break;
+		case 'b':
+			total = parse_size(optarg);
+			break;
+		case 's':
+			max_req = parse_size(optarg);
+			break;
+		case 'p':
+			use_poll = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!total || !max_req)
+		usage(argv[0]);
+	if (use_poll)
+		flags = O_NONBLOCK;
+
+	writer.fd = open(dev_path, O_WRONLY | flags);
+	reader.fd = open(dev_path, O_RDONLY | flags);
+	if (writer.fd < 0 || reader.fd < 0) {
+		perror(dev_path);
+		return EXIT_FAILURE;
+	}
+
+	start = now_ns();
+	if (pthread_create(&reader.thread, NULL, reader_main, &reader) ||
+	    pthread_create(&writer.thread, NULL, writer_main, &writer)) {
+		fprintf(stderr, "cannot start threads\n");
+		return EXIT_FAILURE;
+	}
+	pthread_join(writer.thread, NULL);
+	/* a reader left waiting on a failed writer would never return */
+	if (writer.error)
+		pthread_cancel(reader.thread);
+	pthread_join(reader.thread, NULL);
+	elapsed = now_ns() - start;
+
+	close(writer.fd);
+	close(reader.fd);
+
+	if (writer.error)
+		fprintf(stderr, "write: %s\n", strerror(writer.error));
+	if (reader.error && reader.error != EILSEQ)
+		fprintf(stderr, "read: %s\n", strerror(reader.error));
+
+	printf("%llu bytes written, %llu verified, %.2f MB/s\n",
+	       (unsigned long long)writer.done,
+	       (unsigned long long)reader.done,
+	       elapsed ? reader.done * 1000.0 / elapsed : 0.0);
+
+	return writer.error || reader.error ? EXIT_FAILURE : 0;
+}
@@ -0,0 +1,634 @@
+/*
+ * Throughput and latency benchmark for the lab 9.1 sdma_m2m driver.
+ *
+ * Sweeps transfer sizes, queue depths and thread counts over the transfer
+ * paths of /dev/sdma_test and a plain memcpy() baseline. One record is
+ * printed per configuration, as CSV (default) or as a JSON array, so runs
+ * against different kernel builds can be diffed.
+ *
+ * Modes:
+ *   memcpy  memcpy() between two user buffers, no device involved
+ *   copy    SDMA_IOC_COPY, one blocking copy per call
+ *   submit  SDMA_IOC_SUBMIT/SDMA_IOC_REAP, up to depth copies in flight
+ *   batch   SDMA_IOC_BATCH with SDMA_BATCH_WAIT, depth jobs per call
+ *   kick    SDMA_IOC_KICK inside the mmap() buffer, asynchronous if depth > 1
+ *
+ * The tool only talks to the device node, so it runs on whatever memcpy
+ * channel the driver picked up. When the node is missing only the memcpy
+ * baseline is run. Copies below the driver's cpu_threshold are done by the
+ * CPU, write 0 to /sys/class/misc/sdma_test/cpu_threshold to force the
+ * engine for every size.
+ *
+ * Build: gcc -O2 -Wall -o sdma_bench sdma_bench.c -lpthread
+ * Usage: sdma_bench [-d dev] [-m modes] [-s sizes] [-q depths] [-t threads]
+ *                   [-n iterations] [-f csv|json]
+ * Lists are comma separated, sizes take a K or M suffix.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/utsname.h>
+
+#include "../labs/lab_9_1/sdma_m2m.h"
+
+#define MAX_LIST 32
+#define REAP_MAX 64
+
+enum mode { MODE_MEMCPY, MODE_COPY, MODE_SUBMIT, MODE_BATCH, MODE_KICK };
+
+static const char *mode_names[] = { "memcpy", "copy", "submit", "batch",
+				    "kick" };
+
+struct config {
+	enum mode mode;
+	size_t size;
+	unsigned int depth;
+	unsigned int threads;
+	unsigned int iters;
+};
+
+/* Per-thread state, latencies are in nanoseconds */
+struct worker {
+	pthread_t thread;
+	const struct config *cfg;
+	int fd;
+	char *map; /* the fd's mmap() buffer, kick mode only */
+	char *src;
+	char *dst;
+	uint64_t *lat;
+	unsigned int nr_lat;
+	unsigned int errors;
+	uint64_t start;
+	uint64_t end;
+};
+
+static const char *dev_path = "/dev/sdma_test";
+static size_t mmap_len;
+static pthread_barrier_t start_barrier;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void record(struct worker *w, uint64_t start)
+{
+	w->lat[w->nr_lat++] = now_ns() - start;
+}
+
+static void run_memcpy(struct worker *w)
+{
+	uint64_t start;
+	unsigned int i;
+
+	for (i = 0; i < w->cfg->iters; i++) {
+		start = now_ns();
+		memcpy(w->dst, w->src, w->cfg->size);
+		record(w, start);
+	}
+}
+
+static void run_copy(struct worker *w)
+{
+	struct sdma_copy copy = {
+		.src = (uintptr_t)w->src,
+		.dst = (uintptr_t)w->dst,
+		.len = w->cfg->size,
+	};
+	uint64_t start;
+	unsigned int i;
+
+	for (i = 0; i < w->cfg->iters; i++) {
+		start = now_ns();
+		if (ioctl(w->fd, SDMA_IOC_COPY, &copy))
+			w->errors++;
+		record(w, start);
+	}
+}
+
+static void run_batch(struct worker *w)
+{
+	unsigned int depth = w->cfg->depth;
+	struct sdma_batch batch = { 0 };
+	struct sdma_job *jobs;
+	unsigned int done = 0;
+	unsigned int i, n;
+	uint64_t start;
+
+	jobs = calloc(depth, sizeof(*jobs));
+	if (!jobs) {
+		w->errors = w->cfg->iters;
+		return;
+	}
+
+	batch.jobs = (uintptr_t)jobs;
+	batch.flags = SDMA_BATCH_WAIT;
+
+	while (done < w->cfg->iters) {
+		n = w->cfg->iters - done;
+		if (n > depth)
+			n = depth;
+		for (i = 0; i < n; i++) {
+			jobs[i].src = (uintptr_t)w->src;
+			jobs[i].dst = (uintptr_t)w->dst;
+			jobs[i].len = w->cfg->size;
+		}
+		batch.count = n;
+
+		start = now_ns();
+		if (ioctl(w->fd, SDMA_IOC_BATCH, &batch)) {
+			w->errors += n;
+		} else {
+			for (i = 0; i < n; i++)
+				if (jobs[i].status)
+					w->errors++;
+		}
+		/* every job of a batch sees the latency of the whole call */
+		for (i = 0; i < n; i++)
+			record(w, start);
+		done += n;
+	}
+
+	free(jobs);
+}
+
+static int submit_one(struct worker *w)
+{
+	struct sdma_submit submit = {
+		.src = (uintptr_t)w->src,
+		.dst = (uintptr_t)w->dst,
+		.len = w->cfg->size,
+		.user_data = now_ns(),
+	};
+	struct sdma_kick kick = {
+		.src_off = 0,
+		.dst_off = mmap_len / 2,
+		.len = w->cfg->size,
+		.user_data = now_ns(),
+		.flags = SDMA_KICK_ASYNC,
+	};
+
+	if (w->cfg->mode == MODE_KICK)
+		return ioctl(w->fd, SDMA_IOC_KICK, &kick);
+	return ioctl(w->fd, SDMA_IOC_SUBMIT, &submit);
+}
+
+/*
+ * Keep up to depth copies in flight and time each one from submission to
+ * reap through user_data. Each thread has its own fd and with it its own
+ * completion ring.
+ */
+static void run_async(struct worker *w)
+{
+	struct sdma_completion comp[REAP_MAX];
+	unsigned int sub = 0, reaped = 0;
+	struct sdma_reap reap;
+	uint64_t now;
+	unsigned int i, n;
+
+	while (reaped < w->cfg->iters) {
+		while (sub < w->cfg->iters && sub - reaped < w->cfg->depth) {
+			if (!submit_one(w)) {
+				sub++;
+				continue;
+			}
+			if (errno != EBUSY) {
+				/* count it as done so the loop terminates */
+				w->errors++;
+				sub++;
+				reaped++;
+				continue;
+			}
+			/* depth is above the driver's queue_depth */
+			break;
+		}
+
+		n = sub - reaped;
+		if (!n)
+			continue;
+		if (n > REAP_MAX)
+			n = REAP_MAX;
+
+		reap.entries = (uintptr_t)comp;
+		reap.count = n;
+		reap.min_complete = 1;
+		if (ioctl(w->fd, SDMA_IOC_REAP, &reap)) {
+			if (errno == EINTR)
+				continue;
+			w->errors += n;
+			reaped += n;
+			continue;
+		}
+
+		now = now_ns();
+		for (i = 0; i < reap.count; i++) {
+			if (comp[i].status)
+				w->errors++;
+			w->lat[w->nr_lat++] = now - comp[i].user_data;
+		}
+		reaped += reap.count;
+	}
+}
+
+static void run_kick(struct worker *w)
+{
+	struct sdma_kick kick = {
+		.src_off = 0,
+		.dst_off = mmap_len / 2,
+		.len = w->cfg->size,
+	};
+	uint64_t start;
+	unsigned int i;
+
+	if (w->cfg->depth > 1) {
+		run_async(w);
+		return;
+	}
+
+	for (i = 0; i < w->cfg->iters; i++) {
+		start = now_ns();
+		if (ioctl(w->fd, SDMA_IOC_KICK, &kick))
+			w->errors++;
+		record(w, start);
+	}
+}
+
+static void run_mode(struct worker *w)
+{
+	switch (w->cfg->mode) {
+	case MODE_MEMCPY:
+		run_memcpy(w);
+		break;
+	case MODE_COPY:
+		run_copy(w);
+		break;
+	case MODE_SUBMIT:
+		run_async(w);
+		break;
+	case MODE_BATCH:
+		run_batch(w);
+		break;
+	case MODE_KICK:
+		run_kick(w);
+		break;
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	pthread_barrier_wait(&start_barrier);
+	w->start = now_ns();
+	run_mode(w);
+	w->end = now_ns();
+
+	return NULL;
+}
+
+/* One blocking copy through the mode's path, then compare the buffers */
+static int verify(struct worker *w)
+{
+	struct config cfg = *w->cfg;
+	const struct config *saved = w->cfg;
+	char *src = w->src, *dst = w->dst;
+	size_t i;
+	int ret;
+
+	if (cfg.mode == MODE_KICK) {
+		src = w->map;
+		dst = w->map + mmap_len / 2;
+	}
+
+	for (i = 0; i < cfg.size; i++)
+		src[i] = (char)(i * 7 + 1);
+	memset(dst, 0, cfg.size);
+
+	cfg.iters = 1;
+	cfg.depth = 1;
+	w->cfg = &cfg;
+	run_mode(w);
+	w->cfg = saved;
+	w->nr_lat = 0;
+
+	ret = w->errors || memcmp(src, dst, cfg.size) ? -1 : 0;
+	w->errors = 0;
+	return ret;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint64_t *lat, size_t n, double p)
+{
+	size_t idx;
+
+	if (!n)
+		return 0;
+	idx = (size_t)(p * n);
+	if (idx >= n)
+		idx = n - 1;
+	return lat[idx] / 1000.0;
+}
+
+static void print_record(const char *format, const char *kernel,
+			 const struct config *cfg, double mbps,
+			 const uint64_t *lat, size_t n, unsigned int errors)
+{
+	static int first = 1;
+	double p50 = percentile_us(lat, n, 0.50);
+	double p99 = percentile_us(lat, n, 0.99);
+	double p999 = percentile_us(lat, n, 0.999);
+
+	if (!strcmp(format, "json")) {
+		printf("%s  {\"kernel\": \"%s\", \"mode\": \"%s\", "
+		       "\"size\": %zu, \"depth\": %u, \"threads\": %u, "
+		       "\"ops\": %zu, \"errors\": %u, \"mbps\": %.2f, "
+		       "\"p50_us\": %.2f, \"p99_us\": %.2f, "
+		       "\"p999_us\": %.2f}",
+		       first ? "" : ",\n", kernel, mode_names[cfg->mode],
+		       cfg->size, cfg->depth, cfg->threads, n, errors, mbps,
+		       p50, p99, p999);
+	} else {
+		printf("%s,%s,%zu,%u,%u,%zu,%u,%.2f,%.2f,%.2f,%.2f\n", kernel,
+		       mode_names[cfg->mode], cfg->size, cfg->depth,
+		       cfg->threads, n, errors, mbps, p50, p99, p999);
+	}
+	fflush(stdout);
+	first = 0;
+}
+
+static int run_config(const struct config *cfg, const char *format,
+		      const char *kernel)
+{
+	struct worker *workers;
+	uint64_t *all = NULL;
+	unsigned int errors = 0;
+	size_t n = 0;
+	uint64_t start, end;
+	double mbps;
+	unsigned int i;
+	int ret = -1;
+
+	workers = calloc(cfg->threads, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	for (i = 0; i < cfg->threads; i++) {
+		struct worker *w = &workers[i];
+
+		w->cfg = cfg;
+		w->fd = -1;
+		if (cfg->mode != MODE_MEMCPY) {
+			w->fd = open(dev_path, O_RDWR);
+			if (w->fd < 0) {
+				perror(dev_path);
+				goto out;
+			}
+		}
+		if (cfg->mode == MODE_KICK) {
+			w->map = mmap(NULL, mmap_len, PROT_READ | PROT_WRITE,
+				      MAP_SHARED, w->fd, 0);
+			if (w->map == MAP_FAILED) {
+				w->map = NULL;
+				perror("mmap");
+				goto out;
+			}
+		}
+		w->src = aligned_alloc(4096, (cfg->size + 4095) & ~4095ul);
+		w->dst = aligned_alloc(4096, (cfg->size + 4095) & ~4095ul);
+		w->lat = calloc(cfg->iters, sizeof(*w->lat));
+		if (!w->src || !w->dst || !w->lat)
+			goto out;
+		/* fault the pages in before anything is timed */
+		memset(w->src, 0xa5, cfg->size);
+		memset(w->dst, 0, cfg->size);
+	}
+
+	if (verify(&workers[0])) {
+		fprintf(stderr, "%s %zu: data mismatch, skipped\n",
+			mode_names[cfg->mode], cfg->size);
+		goto out;
+	}
+
+	pthread_barrier_init(&start_barrier, NULL, cfg->threads + 1);
+	for (i = 0; i < cfg->threads; i++)
+		pthread_create(&workers[i].thread, NULL, worker_main,
+			       &workers[i]);
+
+	pthread_barrier_wait(&start_barrier);
+	for (i = 0; i < cfg->threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	pthread_barrier_destroy(&start_barrier);
+
+	/* wall time from the first thread starting to the last finishing */
+	start = workers[0].start;
+	end = workers[0].end;
+	for (i = 1; i < cfg->threads; i++) {
+		if (workers[i].start < start)
+			start = workers[i].start;
+		if (workers[i].end > end)
+			end = workers[i].end;
+	}
+
+	all = malloc((size_t)cfg->threads * cfg->iters * sizeof(*all));
+	if (!all)
+		goto out;
+	for (i = 0; i < cfg->threads; i++) {
+		memcpy(all + n, workers[i].lat,
+		       workers[i].nr_lat * sizeof(*all));
+		n += workers[i].nr_lat;
+		errors += workers[i].errors;
+	}
+	qsort(all, n, sizeof(*all), cmp_u64);
+
+	mbps = (double)cfg->size * n / ((end - start) / 1e9) / 1e6;
+	print_record(format, kernel, cfg, mbps, all, n, errors);
+	ret = 0;
+
+out:
+	for (i = 0; i < cfg->threads; i++) {
+		if (workers[i].map)
+			munmap(workers[i].map, mmap_len);
+		if (workers[i].fd >= 0)
+			close(workers[i].fd);
+		free(workers[i].src);
+		free(workers[i].dst);
+		free(workers[i].lat);
+	}
+	free(workers);
+	free(all);
+	return ret;
+}
+
+static size_t parse_size(const char *s)
+{
+	char *end;
+	size_t v = strtoul(s, &end, 0);
+
+	if (*end == 'K' || *end == 'k')
+		v <<= 10;
+	else if (*end == 'M' || *end == 'm')
+		v <<= 20;
+	return v;
+}
+
+/* Split a comma separated list, returns the number of entries */
+static unsigned int parse_list(char *arg, char **items)
+{
+	unsigned int n = 0;
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok && n < MAX_LIST;
+	     tok = strtok(NULL, ","))
+		items[n++] = tok;
+	return n;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d dev] [-m modes] [-s sizes] [-q depths] "
+		"[-t threads] [-n iterations] [-f csv|json]\n"
+		"  modes: memcpy,copy,submit,batch,kick\n", prog);
+	exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+	char default_modes[] = "memcpy,copy,submit,batch,kick";
+	char default_sizes[] = "64,256,1K,4K,16K,64K,256K,1M";
+	char default_depths[] = "1,8,32";
+	char default_threads[] = "1,2,4";
+	char *modes_arg = default_modes, *sizes_arg = default_sizes;
+	char *depths_arg = default_depths, *threads_arg = default_threads;
+	char *modes[MAX_LIST], *sizes[MAX_LIST], *depths[MAX_LIST];
+	char *threads[MAX_LIST];
+	unsigned int nr_modes, nr_sizes, nr_depths, nr_threads;
+	unsigned int iters = 1000;
+	const char *format = "csv";
+	struct config cfg;
+	struct utsname uts;
+	unsigned int m, s, q, t;
+	int has_dev = 1;
+	__u64 size64;
+	int fd, opt;
+
+	while ((opt = getopt(argc, argv, "d:m:s:q:t:n:f:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			dev_path = optarg;
+			break;
+		case 'm':
+			modes_arg = optarg;
+			break;
+		case 's':
+			sizes_arg = optarg;
+			break;
+		case 'q':
+			depths_arg = optarg;
+			break;
+		case 't':
+			threads_arg = optarg;
+			break;
+		case 'n':
+			iters = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	if (!iters || (strcmp(format, "csv") && strcmp(format, "json")))
+		usage(argv[0]);
+
+	nr_modes = parse_list(modes_arg, modes);
+	nr_sizes = parse_list(sizes_arg, sizes);
+	nr_depths = parse_list(depths_arg, depths);
+	nr_threads = parse_list(threads_arg, threads);
+
+	uname(&uts);
+
+	fd = open(dev_path, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s, running the memcpy baseline only\n",
+			dev_path, strerror(errno));
+		has_dev = 0;
+	} else {
+		if (!ioctl(fd, SDMA_IOC_MMAP_SIZE, &size64))
+			mmap_len = size64;
+		close(fd);
+	}
+
+	if (!strcmp(format, "json"))
+		printf("[\n");
+	else
+		printf("kernel,mode,size,depth,threads,ops,errors,mbps,"
+		       "p50_us,p99_us,p999_us\n");
+
+	for (m = 0; m < nr_modes; m++) {
+		for (cfg.mode = 0; cfg.mode <= MODE_KICK; cfg.mode++)
+			if (!strcmp(modes[m], mode_names[cfg.mode]))
+				break;
+		if (cfg.mode > MODE_KICK) {
+			fprintf(stderr, "unknown mode %s\n", modes[m]);
+			continue;
+		}
+		if (cfg.mode != MODE_MEMCPY && !has_dev)
+			continue;
+
+		for (s = 0; s < nr_sizes; s++) {
+			cfg.size = parse_size(sizes[s]);
+			if (!cfg.size)
+				continue;
+			/* kick copies between the two halves of the buffer */
+			if (cfg.mode == MODE_KICK && cfg.size > mmap_len / 2)
+				continue;
+
+			for (q = 0; q < nr_depths; q++) {
+				cfg.depth = strtoul(depths[q], NULL, 0);
+				if (!cfg.depth)
+					continue;
+				/* a single copy per call, depth is moot */
+				if ((cfg.mode == MODE_MEMCPY ||
+				     cfg.mode == MODE_COPY) && q)
+					break;
+				if (cfg.mode == MODE_MEMCPY ||
+				    cfg.mode == MODE_COPY)
+					cfg.depth = 1;
+
+				for (t = 0; t < nr_threads; t++) {
+					cfg.threads =
+						strtoul(threads[t], NULL, 0);
+					if (!cfg.threads)
+						continue;
+					cfg.iters = iters;
+					run_config(&cfg, format, uts.release);
+				}
+			}
+		}
+	}
+
+	if (!strcmp(format, "json"))
+		printf("\n]\n");
+
+	return 0;
+}
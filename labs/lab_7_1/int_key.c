@@ -4,17 +4,60 @@
 #include <linux/gpio/consumer.h>
 #include <linux/miscdevice.h>
 #include <linux/of_device.h>
+#include <linux/hrtimer.h>
+#include <linux/property.h>
 
 static char *HELLO_KEYS_NAME = "PB_KEY";
 
+/*
+ * With a debounce window from the "debounce-us" property, the first
+ * falling edge of a burst masks the line and arms the timer; the edge
+ * only counts if the line is still low when it fires.
+ */
+struct key_priv {
+	struct device *dev;
+	struct gpio_desc *gpio;
+	int irq;
+	struct hrtimer debounce;
+	u64 debounce_ns;
+};
+
 /* interrupt handler */
 static irqreturn_t hello_keys_isr(int irq, void *data)
 {
-	struct device *dev = data;
-	dev_info(dev, "interrupt received. key: %s\n", HELLO_KEYS_NAME);
+	struct key_priv *priv = data;
+
+	if (priv->debounce_ns) {
+		disable_irq_nosync(irq);
+		hrtimer_start(&priv->debounce, ns_to_ktime(priv->debounce_ns),
+			      HRTIMER_MODE_REL);
+		return IRQ_HANDLED;
+	}
+
+	dev_info(priv->dev, "interrupt received. key: %s\n", HELLO_KEYS_NAME);
 	return IRQ_HANDLED;
 }
 
+/* edges that came in while masked are replayed by enable_irq() */
+static enum hrtimer_restart key_debounce_done(struct hrtimer *timer)
+{
+	struct key_priv *priv = container_of(timer, struct key_priv, debounce);
+
+	if (!gpiod_get_value(priv->gpio))
+		dev_info(priv->dev, "interrupt received. key: %s\n",
+			 HELLO_KEYS_NAME);
+	enable_irq(priv->irq);
+
+	return HRTIMER_NORESTART;
+}
+
+/* leaves the line masked; devm frees the interrupt afterwards */
+static void key_stop(struct key_priv *priv)
+{
+	disable_irq(priv->irq);
+	hrtimer_cancel(&priv->debounce);
+}
+
 static struct miscdevice helloworld_miscdevice = {
 	.minor = MISC_DYNAMIC_MINOR,
 	.name = "mydev",
@@ -23,17 +66,31 @@ static struct miscdevice helloworld_miscdevice = {
 static int my_probe(struct platform_device *pdev)
 {
 	int ret_val, irq;
+	u32 debounce_us = 0;
+	struct key_priv *priv;
 	struct gpio_desc *gpio;
 	struct device *dev = &pdev->dev;
 
 	dev_info(dev, "my_probe() function is called.\n");
 
+	priv = devm_kzalloc(dev, sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	priv->dev = dev;
+	platform_set_drvdata(pdev, priv);
+
+	hrtimer_init(&priv->debounce, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->debounce.function = key_debounce_done;
+	device_property_read_u32(dev, "debounce-us", &debounce_us);
+	priv->debounce_ns = (u64)debounce_us * NSEC_PER_USEC;
+
 	/* First method to get the Linux IRQ number */
 	gpio = devm_gpiod_get(dev, NULL, GPIOD_IN);
 	if (IS_ERR(gpio)) {
 		dev_err(dev, "gpio get failed\n");
 		return PTR_ERR(gpio);
 	}
+	priv->gpio = gpio;
 	irq = gpiod_to_irq(gpio);
 	if (irq < 0)
 		return irq;
@@ -46,10 +103,11 @@ static int my_probe(struct platform_device *pdev)
 		return -EINVAL;
 	}
 	dev_info(dev, "IRQ_using_platform_get_irq: %d\n", irq);
+	priv->irq = irq;
 
 	/* Allocate the interrupt line */
 	ret_val = devm_request_irq(dev, irq, hello_keys_isr,
-				   IRQF_TRIGGER_FALLING, HELLO_KEYS_NAME, dev);
+				   IRQF_TRIGGER_FALLING, HELLO_KEYS_NAME, priv);
 	if (ret_val) {
 		dev_err(dev, "Failed to request interrupt %d, error %d\n", irq,
 			ret_val);
@@ -59,6 +117,7 @@ static int my_probe(struct platform_device *pdev)
 	ret_val = misc_register(&helloworld_miscdevice);
 	if (ret_val != 0) {
 		dev_err(dev, "could not register the misc device mydev\n");
+		key_stop(priv);
 		return ret_val;
 	}
 
@@ -72,6 +131,7 @@ static int my_remove(struct platform_device *pdev)
 {
 	dev_info(&pdev->dev, "my_remove() function is called.\n");
 	misc_deregister(&helloworld_miscdevice);
+	key_stop(platform_get_drvdata(pdev));
 	dev_info(&pdev->dev, "my_remove() function is exited.\n");
 	return 0;
 }
@@ -7,87 +7,352 @@
 #include <linux/interrupt.h>
 #include <linux/miscdevice.h>
 #include <linux/wait.h> /* include wait queue */
-
-#define MAX_KEY_STATES 256
+#include <linux/poll.h>
+#include <linux/ktime.h>
+#include <linux/kfifo.h>
+#include <linux/hrtimer.h>
+#include <linux/property.h>
+#include <linux/mutex.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+
+#include "int_key_wait.h"
+
+static unsigned int fifo_depth = 256;
+module_param(fifo_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(fifo_depth,
+		 "Events queued per device, rounded up to a power of two");
 
 static char *HELLO_KEYS_NAME = "PB_USER";
-static char hello_keys_buf[MAX_KEY_STATES];
-static int buf_rd, buf_wr;
 
+/* bucket n counts latencies in [2^n, 2^(n+1)) ns, the last one up to ~2 s */
+#define KEY_LAT_BUCKETS 32
+
+struct key_lat {
+	u64 count[KEY_LAT_BUCKETS];
+};
+
+/*
+ * The ISR is the only producer of events and read_lock makes readers
+ * take turns as the single consumer, which is all kfifo needs to run
+ * without a lock between the two. When the fifo is full the event is
+ * dropped and counted, and the next one queued carries
+ * KEY_EVENT_OVERFLOW.
+ *
+ * With a debounce window set, the first edge of a burst masks the line
+ * and arms the debounce timer; the timer samples the line once it has
+ * settled, reports it only if it differs from the last state reported,
+ * and unmasks. The timer then stands in for the ISR as the producer.
+ *
+ * Every record handed to a reader adds its age, from the interrupt
+ * timestamp to the moment the reader dequeues it, to a log2 histogram
+ * in debugfs. The counters are per CPU so the reader never bounces a
+ * shared cache line while it is being measured.
+ */
 struct key_priv {
 	struct device *dev;
 	struct gpio_desc *gpio;
 	struct miscdevice int_miscdevice;
 	wait_queue_head_t wq_data_available;
+	DECLARE_KFIFO_PTR(events, struct key_event);
+	struct mutex read_lock;
+	unsigned long dropped;
+	bool overflow;
 	int irq;
+	u16 line;
+	u32 seq;
+	int state;
+	struct hrtimer debounce;
+	u64 debounce_ns;
+	u64 edge_ns;
+	struct key_lat __percpu *lat;
+	struct dentry *debugfs;
 };
 
-static irqreturn_t hello_keys_isr(int irq, void *data)
+/* queue one event; only ever called by the current producer */
+static void key_report(struct key_priv *priv, u64 timestamp_ns, int val)
 {
-	int val;
-	struct key_priv *priv = data;
-	dev_info(priv->dev, "interrupt received. key: %s\n", HELLO_KEYS_NAME);
+	struct key_event ev;
 
-	val = gpiod_get_value(priv->gpio);
-	dev_info(priv->dev, "Button state: 0x%08X\n", val);
+	dev_dbg(priv->dev, "Button state: 0x%08X\n", val);
 
-	if (val == 1)
-		hello_keys_buf[buf_wr++] = 'P';
-	else
-		hello_keys_buf[buf_wr++] = 'R';
+	priv->state = val;
+	ev.timestamp_ns = timestamp_ns;
+	ev.seq = priv->seq++;
+	ev.line = priv->line;
+	ev.edge = val == 1 ? KEY_EDGE_PRESS : KEY_EDGE_RELEASE;
+	ev.flags = priv->overflow ? KEY_EVENT_OVERFLOW : 0;
 
-	if (buf_wr >= MAX_KEY_STATES)
-		buf_wr = 0;
+	if (!kfifo_put(&priv->events, ev)) {
+		WRITE_ONCE(priv->dropped, priv->dropped + 1);
+		priv->overflow = true;
+		return;
+	}
+	priv->overflow = false;
 
 	/* Wake up the process */
 	wake_up_interruptible(&priv->wq_data_available);
+}
+
+static irqreturn_t hello_keys_isr(int irq, void *data)
+{
+	struct key_priv *priv = data;
+	/* take the time first, before anything else delays it */
+	u64 now = ktime_get_ns();
+	u64 window = READ_ONCE(priv->debounce_ns);
+
+	dev_dbg(priv->dev, "interrupt received. key: %s\n", HELLO_KEYS_NAME);
+
+	if (window) {
+		priv->edge_ns = now;
+		disable_irq_nosync(irq);
+		hrtimer_start(&priv->debounce, ns_to_ktime(window),
+			      HRTIMER_MODE_REL);
+		return IRQ_HANDLED;
+	}
+
+	key_report(priv, now, gpiod_get_value(priv->gpio));
 
 	return IRQ_HANDLED;
 }
 
+/*
+ * The line has been quiet for the whole window: report where it settled,
+ * stamped with the first edge of the burst. Edges that arrived while it
+ * was masked are replayed by the core on enable_irq() and open a new
+ * window, so a change right at the end is not lost.
+ */
+static enum hrtimer_restart key_debounce_done(struct hrtimer *timer)
+{
+	struct key_priv *priv = container_of(timer, struct key_priv, debounce);
+	int val = gpiod_get_value(priv->gpio);
+
+	if (val != priv->state)
+		key_report(priv, priv->edge_ns, val);
+	enable_irq(priv->irq);
+
+	return HRTIMER_NORESTART;
+}
+
+/* leaves the line masked; devm frees the interrupt afterwards */
+static void key_stop(struct key_priv *priv)
+{
+	disable_irq(priv->irq);
+	hrtimer_cancel(&priv->debounce);
+}
+
+static void key_lat_record(struct key_priv *priv, u64 ns)
+{
+	unsigned int bucket = ns ? ilog2(ns) : 0;
+
+	if (bucket >= KEY_LAT_BUCKETS)
+		bucket = KEY_LAT_BUCKETS - 1;
+	this_cpu_inc(priv->lat->count[bucket]);
+}
+
 static ssize_t my_dev_read(struct file *file, char __user *buff, size_t count,
 			   loff_t *off)
 {
-	int ret_val;
-	char ch[2];
+	int ret_val = 0;
+	size_t copied = 0;
 	struct key_priv *priv;
+	struct key_event ev;
+	u64 now;
 
 	priv = container_of(file->private_data, struct key_priv,
 			    int_miscdevice);
 
-	dev_info(priv->dev, "mydev_read_file entered\n");
-
-	/* 
-	 * Sleep the process 
-	 * The condition is checked each time the waitqueue is woken up
-         */
-	ret_val = wait_event_interruptible(priv->wq_data_available,
-					   buf_wr != buf_rd);
-	if (ret_val)
-		return ret_val;
+	dev_dbg(priv->dev, "mydev_read_file entered\n");
+
+	if (count < sizeof(struct key_event))
+		return -EINVAL;
+
+	if (mutex_lock_interruptible(&priv->read_lock))
+		return -ERESTARTSYS;
+
+	while (kfifo_is_empty(&priv->events)) {
+		mutex_unlock(&priv->read_lock);
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		/* 
+		 * Sleep the process 
+		 * The condition is checked each time the waitqueue is woken up
+		 */
+		ret_val = wait_event_interruptible(
+			priv->wq_data_available,
+			!kfifo_is_empty(&priv->events));
+		if (ret_val)
+			return ret_val;
+		if (mutex_lock_interruptible(&priv->read_lock))
+			return -ERESTARTSYS;
+	}
 
-	/* Send values to user application*/
-	ch[0] = hello_keys_buf[buf_rd];
-	ch[1] = '\n';
-	if (copy_to_user(buff, &ch, 2)) {
-		return -EFAULT;
+	/*
+	 * Send as many whole records as fit in the user buffer. A record
+	 * only leaves the fifo once it has been copied, so a fault loses
+	 * nothing. The clock is read per record, after the record is seen:
+	 * one queued while we copy would otherwise look older than now.
+	 */
+	while (copied + sizeof(ev) <= count &&
+	       kfifo_peek(&priv->events, &ev)) {
+		now = ktime_get_ns();
+		if (copy_to_user(buff + copied, &ev, sizeof(ev))) {
+			ret_val = -EFAULT;
+			break;
+		}
+		kfifo_skip(&priv->events);
+		key_lat_record(priv, now - ev.timestamp_ns);
+		copied += sizeof(ev);
 	}
+	mutex_unlock(&priv->read_lock);
 
-	buf_rd++;
-	if (buf_rd >= MAX_KEY_STATES)
-		buf_rd = 0;
-	*off += 1;
-	return 2;
+	return copied ? copied : ret_val;
+}
+
+/* readable whenever a record is queued; the ISR wakes the same queue */
+static __poll_t my_dev_poll(struct file *file, poll_table *wait)
+{
+	struct key_priv *priv;
+
+	priv = container_of(file->private_data, struct key_priv,
+			    int_miscdevice);
+
+	poll_wait(file, &priv->wq_data_available, wait);
+
+	return kfifo_is_empty(&priv->events) ? 0 : EPOLLIN | EPOLLRDNORM;
 }
 
 static const struct file_operations my_dev_fops = {
 	.owner = THIS_MODULE,
 	.read = my_dev_read,
+	.poll = my_dev_poll,
 };
 
+/* events lost to a full fifo since the device was probed */
+static ssize_t dropped_show(struct device *dev, struct device_attribute *attr,
+			    char *buf)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct key_priv *priv;
+
+	priv = container_of(misc, struct key_priv, int_miscdevice);
+
+	return sysfs_emit(buf, "%lu\n", READ_ONCE(priv->dropped));
+}
+static DEVICE_ATTR_RO(dropped);
+
+/* edges closer together than this are treated as bounce, 0 disables */
+static ssize_t debounce_us_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct key_priv *priv;
+
+	priv = container_of(misc, struct key_priv, int_miscdevice);
+
+	return sysfs_emit(buf, "%llu\n",
+			  div_u64(READ_ONCE(priv->debounce_ns), NSEC_PER_USEC));
+}
+
+static ssize_t debounce_us_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct key_priv *priv;
+	unsigned int us;
+	int ret;
+
+	priv = container_of(misc, struct key_priv, int_miscdevice);
+
+	ret = kstrtouint(buf, 0, &us);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(priv->debounce_ns, (u64)us * NSEC_PER_USEC);
+
+	return count;
+}
+static DEVICE_ATTR_RW(debounce_us);
+
+static struct attribute *key_attrs[] = {
+	&dev_attr_dropped.attr,
+	&dev_attr_debounce_us.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(key);
+
+/*
+ * One "<lower bound in ns> <events>" line per bucket. Writing anything
+ * clears the histogram; increments racing with the clear may survive it.
+ */
+static int key_lat_show(struct seq_file *s, void *unused)
+{
+	struct key_priv *priv = s->private;
+	unsigned int bucket;
+	u64 sum;
+	int cpu;
+
+	for (bucket = 0; bucket < KEY_LAT_BUCKETS; bucket++) {
+		sum = 0;
+		for_each_possible_cpu(cpu)
+			sum += per_cpu_ptr(priv->lat, cpu)->count[bucket];
+		seq_printf(s, "%llu %llu\n", bucket ? 1ULL << bucket : 0ULL,
+			   sum);
+	}
+
+	return 0;
+}
+
+static int key_lat_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, key_lat_show, inode->i_private);
+}
+
+static ssize_t key_lat_write(struct file *file, const char __user *buf,
+			     size_t count, loff_t *ppos)
+{
+	struct key_priv *priv = file_inode(file)->i_private;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+		memset(per_cpu_ptr(priv->lat, cpu), 0, sizeof(struct key_lat));
+
+	return count;
+}
+
+static const struct file_operations key_lat_fops = {
+	.owner = THIS_MODULE,
+	.open = key_lat_open,
+	.read = seq_read,
+	.write = key_lat_write,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void key_remove_debugfs(void *data)
+{
+	struct key_priv *priv = data;
+
+	debugfs_remove_recursive(priv->debugfs);
+}
+
+static void key_free_fifo(void *data)
+{
+	struct key_priv *priv = data;
+
+	kfifo_free(&priv->events);
+}
+
 static int my_probe(struct platform_device *pdev)
 {
 	int ret_val;
+	u32 debounce_us = 0;
+	char name[64];
 	struct key_priv *priv;
 	struct device *dev = &pdev->dev;
 
@@ -95,12 +360,41 @@ static int my_probe(struct platform_device *pdev)
 
 	/* Allocate new structure representing device */
 	priv = devm_kzalloc(dev, sizeof(struct key_priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
 	priv->dev = dev;
 
 	platform_set_drvdata(pdev, priv);
 
 	/* Init the wait queue head */
 	init_waitqueue_head(&priv->wq_data_available);
+	mutex_init(&priv->read_lock);
+
+	hrtimer_init(&priv->debounce, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	priv->debounce.function = key_debounce_done;
+	device_property_read_u32(dev, "debounce-us", &debounce_us);
+	priv->debounce_ns = (u64)debounce_us * NSEC_PER_USEC;
+
+	/* freed by devm after the interrupt, which is requested later */
+	ret_val = kfifo_alloc(&priv->events, max(fifo_depth, 2U), GFP_KERNEL);
+	if (ret_val)
+		return ret_val;
+	ret_val = devm_add_action_or_reset(dev, key_free_fifo, priv);
+	if (ret_val)
+		return ret_val;
+
+	priv->lat = devm_alloc_percpu(dev, struct key_lat);
+	if (!priv->lat)
+		return -ENOMEM;
+
+	/* debugfs/intkeywait-<device>/latency */
+	snprintf(name, sizeof(name), "intkeywait-%s", dev_name(dev));
+	priv->debugfs = debugfs_create_dir(name, NULL);
+	debugfs_create_file("latency", 0600, priv->debugfs, priv,
+			    &key_lat_fops);
+	ret_val = devm_add_action_or_reset(dev, key_remove_debugfs, priv);
+	if (ret_val)
+		return ret_val;
 
 	/* Get Linux IRQ number from device tree using 2 methods */
 	priv->gpio = devm_gpiod_get(dev, NULL, GPIOD_IN);
@@ -108,6 +402,7 @@ static int my_probe(struct platform_device *pdev)
 		dev_err(dev, "gpio get failed\n");
 		return PTR_ERR(priv->gpio);
 	}
+	priv->line = desc_to_gpio(priv->gpio);
 	priv->irq = gpiod_to_irq(priv->gpio);
 	if (priv->irq < 0)
 		return priv->irq;
@@ -120,6 +415,8 @@ static int my_probe(struct platform_device *pdev)
 	}
 	dev_info(dev, "IRQ_using_platform_get_irq: %d\n", priv->irq);
 
+	priv->state = gpiod_get_value(priv->gpio);
+
 	ret_val = devm_request_irq(dev, priv->irq, hello_keys_isr,
 				   IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING,
 				   HELLO_KEYS_NAME, priv);
@@ -132,10 +429,12 @@ static int my_probe(struct platform_device *pdev)
 	priv->int_miscdevice.name = "mydev";
 	priv->int_miscdevice.minor = MISC_DYNAMIC_MINOR;
 	priv->int_miscdevice.fops = &my_dev_fops;
+	priv->int_miscdevice.groups = key_groups;
 
 	ret_val = misc_register(&priv->int_miscdevice);
 	if (ret_val != 0) {
 		dev_err(dev, "could not register the misc device mydev\n");
+		key_stop(priv);
 		return ret_val;
 	}
 
@@ -149,6 +448,7 @@ static int my_remove(struct platform_device *pdev)
 	struct key_priv *priv = platform_get_drvdata(pdev);
 	dev_info(&pdev->dev, "my_remove() function is called.\n");
 	misc_deregister(&priv->int_miscdevice);
+	key_stop(priv);
 	dev_info(&pdev->dev, "my_remove() function is exited.\n");
 	return 0;
 }
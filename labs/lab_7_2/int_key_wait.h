@@ -0,0 +1,32 @@
+#ifndef INT_KEY_WAIT_H
+#define INT_KEY_WAIT_H
+
+#include <linux/types.h>
+
+#define KEY_EDGE_RELEASE 0
+#define KEY_EDGE_PRESS 1
+
+/* events were dropped on a full queue just before this one */
+#define KEY_EVENT_OVERFLOW (1 << 0)
+
+/*
+ * One record per edge seen on the key line. read() on /dev/mydev hands
+ * back as many whole records as fit in the user buffer, oldest first,
+ * and fails with EINVAL when the buffer cannot hold even one. seq counts
+ * dropped events too, so a gap after KEY_EVENT_OVERFLOW tells how many
+ * were lost; the running total is in the device's dropped attribute.
+ *
+ * When the device's debounce_us attribute is non-zero, a burst of edges
+ * within that window yields at most one record, carrying the level the
+ * line settled at and the time of the burst's first edge. A burst that
+ * settles back where it started yields none.
+ */
+struct key_event {
+	__u64 timestamp_ns; /* CLOCK_MONOTONIC, taken in the interrupt */
+	__u32 seq; /* per device, incremented for every edge */
+	__u16 line; /* GPIO number of the key */
+	__u8 edge; /* KEY_EDGE_PRESS or KEY_EDGE_RELEASE */
+	__u8 flags; /* KEY_EVENT_OVERFLOW */
+};
+
+#endif /* INT_KEY_WAIT_H */
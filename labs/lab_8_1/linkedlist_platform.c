@@ -2,198 +2,1109 @@
 #include <linux/fs.h>
 #include <linux/platform_device.h>
 #include <linux/uaccess.h>
+#include <linux/uio.h>
 #include <linux/miscdevice.h>
-#include <linux/delay.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/poll.h>
+#include <linux/wait.h>
+#include <linux/overflow.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/log2.h>
+#include <linux/shrinker.h>
 #include <linux/of_device.h>
 
-static int BlockNumber = 10;
-static int BlockSize = 5;
-static int size_to_read = 0;
-static int node_count = 1;
-static int cnt = 0;
+#include "linkedlist_platform.h"
+
+static unsigned int block_size = PAGE_SIZE;
+module_param(block_size, uint, S_IRUGO);
+MODULE_PARM_DESC(block_size, "Size in bytes of each list block");
+
+static unsigned int block_count = 16;
+module_param(block_count, uint, S_IRUGO);
+MODULE_PARM_DESC(block_count, "Number of blocks in the list");
+
+static bool broadcast;
+module_param(broadcast, bool, S_IRUGO);
+MODULE_PARM_DESC(broadcast, "Give every open file its own read cursor");
+
+static unsigned int max_extra_blocks = 16;
+module_param(max_extra_blocks, uint, S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(max_extra_blocks,
+		 "Blocks a full list may borrow on top of block_count");
 
 typedef struct dnode {
 	char *buffer;
 	struct dnode *next;
 } data_node;
 
-typedef struct lnode {
+/* a block added on top of the arena when a burst fills the list */
+struct list_block {
+	data_node node;
+	char payload[];
+};
+
+/*
+ * A position in the ring: the node being filled or drained, the offset
+ * inside its buffer and the ring position both stand for. Each side of
+ * the ring owns exactly one. A cursor that reaches the end of a block
+ * stays there until it has something to move into the next one, so the
+ * reader only follows a next pointer once the data behind it has been
+ * published, which lets the writer insert blocks after its own.
+ */
+typedef struct lcursor {
+	data_node *node;
+	unsigned int offset;
+	u32 pos;
+} list_cursor;
+
+/*
+ * The circular list is a single-producer/single-consumer ring. The head
+ * and tail indices in the control page count every byte ever written
+ * and read; the owner of each index publishes it with a release store
+ * once the data it covers has been copied, and the other side picks it
+ * up with an acquire load. write_lock and read_lock only serialize
+ * several writers (or readers) among themselves, so one writer and one
+ * reader never share a lock. Resizing and mmap() take both, always
+ * write_lock first.
+ *
+ * In broadcast mode every open file reads through its own cursor and
+ * tail only marks the oldest byte still intact: the writer never waits,
+ * it pushes tail forward before overwriting and readers left behind get
+ * -EOVERFLOW. Switching modes or resizing needs the device closed by
+ * everybody: poll() and the sleeping readers and writers look at the
+ * indices in the arena without a lock, so it cannot be freed under an
+ * open file.
+ *
+ * A writer that finds the list full at a block boundary may borrow a
+ * block from block_cache and link it in after its own, up to
+ * max_extra_blocks; the shrinker hands back the borrowed blocks that
+ * hold no data. Borrowing breaks the plain mapping from a position to
+ * a block, so it is off for mapped and broadcast rings, and linear
+ * records whether the mapping still holds.
+ */
+struct list_priv {
+	struct miscdevice list_miscdevice;
+	struct device *dev;
+	void *arena;
+	struct list_ring *ring;
 	data_node *head;
-	data_node *cur_write_node;
-	data_node *cur_read_node;
-	int cur_read_offset;
-	int cur_write_offset;
-} liste;
+	unsigned int block_size;
+	unsigned int block_count;
+	size_t capacity;
+	size_t map_size;
+	bool broadcast;
+	bool linear;
+	struct kmem_cache *block_cache;
+	unsigned int nr_extra;
+	size_t footprint;
+	size_t peak_footprint;
+	struct shrinker shrinker;
+	atomic_t nr_maps;
+	atomic_t nr_open;
+
+	/* writers sleep here while the ring is full, readers while empty */
+	wait_queue_head_t wq_write;
+	wait_queue_head_t wq_read;
 
-static liste newListe;
+	struct mutex write_lock ____cacheline_aligned_in_smp;
+	list_cursor wr_cur;
 
-static int createlist(struct platform_device *pdev)
+	struct mutex read_lock ____cacheline_aligned_in_smp;
+	list_cursor rd_cur;
+};
+
+/* per open file; the cursor and its lock are only used in broadcast mode */
+struct list_file {
+	struct list_priv *priv;
+	struct mutex lock;
+	list_cursor cur;
+};
+
+/*
+ * Build the circular list in a single arena: the control page, the
+ * payload of every block back to back, then the nodes on the following
+ * page. The first two parts are what mmap() hands out; keeping the nodes
+ * on their own pages keeps kernel pointers out of user space.
+ */
+static void *createlist(unsigned int size, unsigned int count)
 {
-	data_node *newNode, *previousNode, *headNode;
-	int i;
+	data_node *nodes;
+	size_t payload, total;
+	void *arena;
+	unsigned int i;
+
+	if (!size || !count)
+		return NULL;
+	/* the indices are 32-bit, the capacity must stay well below that */
+	if (check_mul_overflow((size_t)size, (size_t)count, &payload) ||
+	    payload > INT_MAX ||
+	    check_mul_overflow(sizeof(data_node), (size_t)count, &total) ||
+	    check_add_overflow((size_t)(PAGE_SIZE + PAGE_ALIGN(payload)), total,
+			       &total))
+		return NULL;
+
+	arena = vmalloc_user(total);
+	if (!arena)
+		return NULL;
+
+	nodes = arena + PAGE_SIZE + PAGE_ALIGN(payload);
+	for (i = 0; i < count; i++) {
+		nodes[i].buffer = arena + PAGE_SIZE + (size_t)i * size;
+		nodes[i].next = &nodes[(i + 1) % count];
+	}
+
+	return arena;
+}
+
+static struct kmem_cache *list_cache_create(unsigned int size)
+{
+	return kmem_cache_create("linkedmem_block",
+				 struct_size((struct list_block *)NULL,
+					     payload, size),
+				 0, 0, NULL);
+}
+
+static bool list_node_extra(struct list_priv *priv, data_node *node)
+{
+	return node < priv->head || node >= priv->head + priv->block_count;
+}
+
+static void list_account(struct list_priv *priv, ssize_t delta)
+{
+	WRITE_ONCE(priv->footprint, priv->footprint + delta);
+	if (priv->footprint > priv->peak_footprint)
+		WRITE_ONCE(priv->peak_footprint, priv->footprint);
+}
+
+/* unlink and free the borrowed block after prev; both locks held */
+static void list_drop_next(struct list_priv *priv, data_node *prev)
+{
+	data_node *node = prev->next;
+
+	WRITE_ONCE(prev->next, node->next);
+	kmem_cache_free(priv->block_cache,
+			container_of(node, struct list_block, node));
+	WRITE_ONCE(priv->nr_extra, priv->nr_extra - 1);
+	WRITE_ONCE(priv->capacity, priv->capacity - priv->block_size);
+	priv->ring->capacity = priv->capacity;
+	list_account(priv, -(ssize_t)kmem_cache_size(priv->block_cache));
+}
 
-	/* new node creation */
-	newNode = devm_kmalloc(&pdev->dev, sizeof(data_node), GFP_KERNEL);
-	if (newNode)
-		newNode->buffer = devm_kmalloc(
-			&pdev->dev, BlockSize * sizeof(char), GFP_KERNEL);
-	if (!newNode || !newNode->buffer)
+/* give back every borrowed block; the cursors must be reset afterwards */
+static void list_free_extra(struct list_priv *priv)
+{
+	data_node *node = priv->head;
+
+	if (!priv->nr_extra)
+		return;
+
+	do {
+		while (list_node_extra(priv, node->next))
+			list_drop_next(priv, node);
+		node = node->next;
+	} while (node != priv->head);
+}
+
+static bool list_can_grow(struct list_priv *priv)
+{
+	return !priv->broadcast && !atomic_read(&priv->nr_maps) &&
+	       priv->nr_extra < READ_ONCE(max_extra_blocks) &&
+	       priv->capacity + priv->block_size <= INT_MAX;
+}
+
+/*
+ * Borrow a block for a writer parked at the end of its block. The new
+ * block goes right after the writer's, ahead of the oldest data, and the
+ * reader can only reach it once head has moved into it. Called with
+ * write_lock held; fails quietly so the writer falls back to waiting.
+ */
+static bool list_grow(struct list_priv *priv)
+{
+	data_node *node = priv->wr_cur.node;
+	struct list_block *blk;
+
+	if (priv->wr_cur.offset != priv->block_size || !list_can_grow(priv))
+		return false;
+
+	blk = kmem_cache_alloc(priv->block_cache,
+			       GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+	if (!blk)
+		return false;
+
+	blk->node.buffer = blk->payload;
+	blk->node.next = node->next;
+	WRITE_ONCE(node->next, &blk->node);
+
+	WRITE_ONCE(priv->nr_extra, priv->nr_extra + 1);
+	WRITE_ONCE(priv->capacity, priv->capacity + priv->block_size);
+	priv->ring->capacity = priv->capacity;
+	priv->linear = false;
+	list_account(priv, kmem_cache_size(priv->block_cache));
+
+	return true;
+}
+
+/* empty the ring; called with both locks held */
+static void list_reset(struct list_priv *priv)
+{
+	list_free_extra(priv);
+	priv->linear = true;
+
+	priv->wr_cur.node = priv->head;
+	priv->wr_cur.offset = 0;
+	priv->wr_cur.pos = 0;
+	priv->rd_cur.node = priv->head;
+	priv->rd_cur.offset = 0;
+	priv->rd_cur.pos = 0;
+
+	priv->ring->head = 0;
+	priv->ring->tail = 0;
+	priv->ring->flags = priv->broadcast ? LIST_RING_BROADCAST : 0;
+}
+
+/* called with both locks held, or before the device is registered */
+static void list_install(struct list_priv *priv, void *arena,
+			 struct kmem_cache *cache, unsigned int size,
+			 unsigned int count)
+{
+	size_t payload = (size_t)size * count;
+
+	priv->arena = arena;
+	priv->block_cache = cache;
+	priv->nr_extra = 0;
+	priv->footprint = 0;
+	list_account(priv, PAGE_SIZE + PAGE_ALIGN(payload) +
+				   PAGE_ALIGN(count * sizeof(data_node)));
+	priv->ring = arena;
+	priv->head = arena + PAGE_SIZE + PAGE_ALIGN(payload);
+	priv->block_size = size;
+	priv->block_count = count;
+	priv->capacity = payload;
+	priv->map_size = PAGE_SIZE + PAGE_ALIGN(payload);
+
+	priv->ring->capacity = payload;
+	priv->ring->block_size = size;
+	priv->ring->block_count = count;
+	priv->ring->data_offset = PAGE_SIZE;
+	priv->ring->map_size = priv->map_size;
+	list_reset(priv);
+}
+
+/*
+ * Skip the wait queue lock when nobody sleeps; wq_has_sleeper() orders
+ * the index just published against the waiter's condition check.
+ */
+static void list_wake(wait_queue_head_t *wq, __poll_t events)
+{
+	if (wq_has_sleeper(wq))
+		wake_up_interruptible_poll(wq, events);
+}
+
+/*
+ * Nothing may be holding on to the current ring: no mapping and no open
+ * file. Checked under read_lock, which open() takes to count itself.
+ */
+static bool list_busy(struct list_priv *priv)
+{
+	return atomic_read(&priv->nr_maps) || atomic_read(&priv->nr_open);
+}
+
+/* swap in a new arena, refused while the old one is busy */
+static int list_resize(struct list_priv *priv, unsigned int size,
+		       unsigned int count)
+{
+	struct kmem_cache *cache, *old_cache;
+	void *arena, *old;
+	int ret = 0;
+
+	arena = createlist(size, count);
+	if (!arena)
+		return size && count ? -ENOMEM : -EINVAL;
+	cache = list_cache_create(size);
+	if (!cache) {
+		vfree(arena);
 		return -ENOMEM;
-	newNode->next = NULL;
+	}
+
+	mutex_lock(&priv->write_lock);
+	mutex_lock(&priv->read_lock);
+	if (list_busy(priv)) {
+		old = arena;
+		old_cache = cache;
+		ret = -EBUSY;
+	} else if (priv->broadcast && !is_power_of_2((size_t)size * count)) {
+		old = arena;
+		old_cache = cache;
+		ret = -EINVAL;
+	} else {
+		old = priv->arena;
+		old_cache = priv->block_cache;
+		list_free_extra(priv);
+		list_install(priv, arena, cache, size, count);
+	}
+	mutex_unlock(&priv->read_lock);
+	mutex_unlock(&priv->write_lock);
+
+	kmem_cache_destroy(old_cache);
+	vfree(old);
+	if (!ret)
+		list_wake(&priv->wq_write, EPOLLOUT | EPOLLWRNORM);
+	return ret;
+}
+
+/* switching modes throws away whatever the ring holds */
+static int list_set_broadcast(struct list_priv *priv, bool on)
+{
+	int ret = 0;
+
+	mutex_lock(&priv->write_lock);
+	mutex_lock(&priv->read_lock);
+	if (atomic_read(&priv->nr_maps) || atomic_read(&priv->nr_open)) {
+		ret = -EBUSY;
+	} else if (on && !is_power_of_2(priv->capacity)) {
+		ret = -EINVAL;
+	} else {
+		priv->broadcast = on;
+		list_reset(priv);
+	}
+	mutex_unlock(&priv->read_lock);
+	mutex_unlock(&priv->write_lock);
 
-	newListe.head = newNode;
-	headNode = newNode;
-	previousNode = newNode;
+	return ret;
+}
+
+static void list_cursor_advance(list_cursor *cur, size_t len)
+{
+	cur->pos += len;
+	cur->offset += len;
+}
 
-	for (i = 1; i < BlockNumber; i++) {
-		newNode =
-			devm_kmalloc(&pdev->dev, sizeof(data_node), GFP_KERNEL);
-		if (newNode)
-			newNode->buffer = devm_kmalloc(&pdev->dev,
-						       BlockSize * sizeof(char),
-						       GFP_KERNEL);
-		if (!newNode || !newNode->buffer)
-			return -ENOMEM;
-		newNode->next = NULL;
-		previousNode->next = newNode;
-		previousNode = newNode;
+/* move a cursor parked at the end of its block into the next one */
+static void list_cursor_step(list_cursor *cur, unsigned int size)
+{
+	if (cur->offset == size) {
+		cur->node = READ_ONCE(cur->node->next);
+		cur->offset = 0;
 	}
+}
 
-	newNode->next = headNode;
+/*
+ * Point a cursor at a ring position. Only used where the capacity is a
+ * power of two, mapped or broadcast rings, so the position maps straight
+ * onto a node and an offset.
+ */
+static void list_cursor_seek(struct list_priv *priv, list_cursor *cur,
+			     u32 pos)
+{
+	u32 off = pos & (priv->capacity - 1);
 
-	newListe.cur_read_node = headNode;
-	newListe.cur_write_node = headNode;
-	newListe.cur_read_offset = 0;
-	newListe.cur_write_offset = 0;
+	cur->node = &priv->head[off / priv->block_size];
+	cur->offset = off % priv->block_size;
+	cur->pos = pos;
+}
 
-	return 0;
+/*
+ * Bring a cursor in line with its index. Only a process that has the
+ * ring mapped can move an index behind the driver's back.
+ */
+static void list_cursor_sync(struct list_priv *priv, list_cursor *cur,
+			     u32 pos)
+{
+	if (unlikely(cur->pos != pos))
+		list_cursor_seek(priv, cur, pos);
 }
 
-static ssize_t my_dev_write(struct file *file, const char __user *buf,
-			    size_t size, loff_t *offset)
+/*
+ * Copy up to len bytes between the ring and an iterator, walking block
+ * by block and publishing the index after every block so the other side
+ * can start on it right away. Called with the side's lock held; returns
+ * the number of bytes moved, short only on a fault.
+ */
+static size_t list_fill(struct list_priv *priv, struct iov_iter *from,
+			size_t len)
 {
-	int size_to_copy;
-	pr_info("my_dev_write() is called.\n");
-	pr_info("node_number_%d\n", node_count);
+	u32 wr = priv->wr_cur.pos;
+	size_t size_to_copy, copied, done = 0;
 
-	if ((*(offset) == 0) || (node_count == 1)) {
-		size_to_read += size;
+	while (done < len) {
+		list_cursor_step(&priv->wr_cur, priv->block_size);
+		size_to_copy = min(len - done,
+				   (size_t)(priv->block_size -
+					    priv->wr_cur.offset));
+		copied = copy_from_iter(priv->wr_cur.node->buffer +
+						priv->wr_cur.offset,
+					size_to_copy, from);
+		list_cursor_advance(&priv->wr_cur, copied);
+		done += copied;
+		smp_store_release(&priv->ring->head, wr + done);
+		if (copied != size_to_copy)
+			break;
 	}
 
-	if (size < BlockSize - newListe.cur_write_offset)
-		size_to_copy = size;
-	else
-		size_to_copy = BlockSize - newListe.cur_write_offset;
+	return done;
+}
 
-	if (copy_from_user(newListe.cur_write_node->buffer +
-				   newListe.cur_write_offset,
-			   buf, size_to_copy)) {
-		return -EFAULT;
+/* broadcast readers drain through their own cursor and publish nothing */
+static size_t list_drain(struct list_priv *priv, list_cursor *cur,
+			 struct iov_iter *to, size_t len, bool publish)
+{
+	u32 rd = cur->pos;
+	size_t size_to_copy, copied, done = 0;
+
+	while (done < len) {
+		list_cursor_step(cur, priv->block_size);
+		size_to_copy = min(len - done,
+				   (size_t)(priv->block_size - cur->offset));
+		copied = copy_to_iter(cur->node->buffer + cur->offset,
+				      size_to_copy, to);
+		list_cursor_advance(cur, copied);
+		done += copied;
+		if (publish)
+			smp_store_release(&priv->ring->tail, rd + done);
+		if (copied != size_to_copy)
+			break;
 	}
-	*(offset) += size_to_copy;
-	newListe.cur_write_offset += size_to_copy;
-	if (newListe.cur_write_offset == BlockSize) {
-		newListe.cur_write_node = newListe.cur_write_node->next;
-		newListe.cur_write_offset = 0;
-		node_count = node_count + 1;
-		if (node_count > BlockNumber) {
-			newListe.cur_read_node = newListe.cur_write_node;
-			newListe.cur_read_offset = 0;
-			node_count = 1;
-			cnt = 0;
-			size_to_read = 0;
-		}
+
+	return done;
+}
+
+/*
+ * A broadcast writer about to store len bytes at wr first moves tail
+ * past everything those bytes overwrite, so a reader that still finds
+ * tail behind its start after copying knows the copy is intact.
+ */
+static void list_overwrite(struct list_priv *priv, u32 wr, size_t len)
+{
+	u32 oldest = wr + len - priv->capacity;
+
+	if ((s32)(oldest - READ_ONCE(priv->ring->tail)) > 0) {
+		WRITE_ONCE(priv->ring->tail, oldest);
+		/* pairs with the smp_rmb() in list_read_broadcast() */
+		smp_wmb();
 	}
-	return size_to_copy;
 }
 
-static ssize_t my_dev_read(struct file *file, char __user *buf, size_t count,
-			   loff_t *offset)
+static u32 list_used(struct list_priv *priv)
 {
-	int size_to_copy;
-	int read_value;
+	return READ_ONCE(priv->ring->head) - READ_ONCE(priv->ring->tail);
+}
 
-	read_value = (size_to_read - (BlockSize * cnt));
+static bool list_nonblock(struct kiocb *iocb)
+{
+	return (iocb->ki_filp->f_flags & O_NONBLOCK) ||
+	       (iocb->ki_flags & IOCB_NOWAIT);
+}
 
-	if ((*offset) < size_to_read) {
-		if (read_value < BlockSize - newListe.cur_read_offset)
-			size_to_copy = read_value;
-		else
-			size_to_copy = BlockSize - newListe.cur_read_offset;
-		if (copy_to_user(buf,
-				 newListe.cur_read_node->buffer +
-					 newListe.cur_read_offset,
-				 size_to_copy)) {
-			return -EFAULT;
+/*
+ * A blocking write waits for room until the whole request is in the
+ * ring, like a pipe; a non-blocking one takes what fits and fails with
+ * -EAGAIN only when nothing does. The lock is dropped while sleeping so
+ * mmap() and the shrinker are never stuck behind a writer waiting on a
+ * full ring. In broadcast mode the ring is never full.
+ */
+static ssize_t my_dev_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	struct list_file *lf = iocb->ki_filp->private_data;
+	struct list_priv *priv = lf->priv;
+	size_t space, room, len, copied, done = 0;
+	ssize_t ret = 0;
+	u32 wr, used;
+
+	if (!iov_iter_count(from))
+		return 0;
+
+	if (mutex_lock_interruptible(&priv->write_lock))
+		return -ERESTARTSYS;
+
+	while (iov_iter_count(from)) {
+		wr = READ_ONCE(priv->ring->head);
+		/* pairs with the release in list_drain(): slots are free */
+		used = wr - smp_load_acquire(&priv->ring->tail);
+		if (used > priv->capacity) {
+			ret = -EIO;
+			break;
 		}
-		newListe.cur_read_offset += size_to_copy;
-		(*offset) += size_to_copy;
+		list_cursor_sync(priv, &priv->wr_cur, wr);
 
-		if (newListe.cur_read_offset == BlockSize) {
-			cnt = cnt + 1;
-			newListe.cur_read_node = newListe.cur_read_node->next;
-			newListe.cur_read_offset = 0;
+		space = priv->capacity;
+		if (!priv->broadcast)
+			space -= used;
+		if (space < priv->block_size && list_grow(priv))
+			continue;
+		if (!space) {
+			if (list_nonblock(iocb)) {
+				ret = -EAGAIN;
+				break;
+			}
+			mutex_unlock(&priv->write_lock);
+			ret = wait_event_interruptible(
+				priv->wq_write,
+				list_used(priv) < READ_ONCE(priv->capacity));
+			if (ret)
+				goto out;
+			if (mutex_lock_interruptible(&priv->write_lock)) {
+				ret = -ERESTARTSYS;
+				goto out;
+			}
+			continue;
 		}
-		return size_to_copy;
+
+		len = min(space, iov_iter_count(from));
+		/*
+		 * With less than a whole block free past the end of this
+		 * one, stop at its end so the next round can borrow one.
+		 */
+		room = priv->block_size - priv->wr_cur.offset;
+		if (room && space > room &&
+		    space - room < priv->block_size && list_can_grow(priv))
+			len = min(len, room);
+		if (priv->broadcast)
+			list_overwrite(priv, wr, len);
+		copied = list_fill(priv, from, len);
+		done += copied;
+		if (copied)
+			list_wake(&priv->wq_read, EPOLLIN | EPOLLRDNORM);
+		if (copied != len) {
+			ret = -EFAULT;
+			break;
+		}
+	}
+	mutex_unlock(&priv->write_lock);
+out:
+	return done ? done : ret;
+}
+
+/*
+ * Check where a broadcast cursor stands against the ring: returns
+ * -EOVERFLOW, after moving the cursor up to the oldest intact byte, when
+ * the writer has lapped it, otherwise the number of bytes it can read.
+ */
+static ssize_t list_reader_avail(struct list_file *lf)
+{
+	struct list_priv *priv = lf->priv;
+	u32 wr, rd;
+
+	/* pairs with the release in list_fill(): data is in place */
+	wr = smp_load_acquire(&priv->ring->head);
+	rd = READ_ONCE(priv->ring->tail);
+
+	if ((s32)(rd - lf->cur.pos) > 0) {
+		list_cursor_seek(priv, &lf->cur, rd);
+		return -EOVERFLOW;
+	}
+	/* only a mapped producer can have taken head backwards */
+	if ((s32)(lf->cur.pos - wr) > 0)
+		list_cursor_seek(priv, &lf->cur, wr);
+
+	return wr - lf->cur.pos;
+}
+
+static ssize_t list_read_broadcast(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct list_file *lf = iocb->ki_filp->private_data;
+	struct list_priv *priv = lf->priv;
+	size_t copied;
+	ssize_t avail;
+	u32 start;
+	int ret;
+
+	if (mutex_lock_interruptible(&lf->lock))
+		return -ERESTARTSYS;
+
+	for (;;) {
+		avail = list_reader_avail(lf);
+		if (avail)
+			break;
+		mutex_unlock(&lf->lock);
+		if (list_nonblock(iocb))
+			return -EAGAIN;
+		ret = wait_event_interruptible(
+			priv->wq_read,
+			READ_ONCE(priv->ring->head) != READ_ONCE(lf->cur.pos));
+		if (ret)
+			return ret;
+		if (mutex_lock_interruptible(&lf->lock))
+			return -ERESTARTSYS;
+	}
+	if (avail < 0)
+		goto out;
+
+	start = lf->cur.pos;
+	copied = list_drain(priv, &lf->cur, to,
+			    min((size_t)avail, iov_iter_count(to)), false);
+
+	/* pairs with the smp_wmb() in list_overwrite() */
+	smp_rmb();
+	if ((s32)(READ_ONCE(priv->ring->tail) - start) > 0) {
+		list_cursor_seek(priv, &lf->cur, READ_ONCE(priv->ring->tail));
+		avail = -EOVERFLOW;
 	} else {
-		msleep(250);
-		newListe.cur_read_node = newListe.head;
-		newListe.cur_write_node = newListe.head;
-		newListe.cur_read_offset = 0;
-		newListe.cur_write_offset = 0;
-		node_count = 1;
-		cnt = 0;
-		size_to_read = 0;
+		avail = copied ? copied : -EFAULT;
+	}
+out:
+	mutex_unlock(&lf->lock);
+	return avail;
+}
+
+static ssize_t my_dev_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct list_file *lf = iocb->ki_filp->private_data;
+	struct list_priv *priv = lf->priv;
+	size_t len, copied;
+	u32 rd, avail;
+	int ret;
+
+	if (!iov_iter_count(to))
 		return 0;
+
+	if (priv->broadcast)
+		return list_read_broadcast(iocb, to);
+
+	if (mutex_lock_interruptible(&priv->read_lock))
+		return -ERESTARTSYS;
+
+	for (;;) {
+		rd = READ_ONCE(priv->ring->tail);
+		/* pairs with the release in list_fill(): data is in place */
+		avail = smp_load_acquire(&priv->ring->head) - rd;
+		if (avail > READ_ONCE(priv->capacity)) {
+			mutex_unlock(&priv->read_lock);
+			return -EIO;
+		}
+		if (avail)
+			break;
+		mutex_unlock(&priv->read_lock);
+		if (list_nonblock(iocb))
+			return -EAGAIN;
+		ret = wait_event_interruptible(priv->wq_read, list_used(priv));
+		if (ret)
+			return ret;
+		if (mutex_lock_interruptible(&priv->read_lock))
+			return -ERESTARTSYS;
 	}
+
+	list_cursor_sync(priv, &priv->rd_cur, rd);
+	len = min((size_t)avail, iov_iter_count(to));
+	copied = list_drain(priv, &priv->rd_cur, to, len, true);
+	mutex_unlock(&priv->read_lock);
+
+	if (copied)
+		list_wake(&priv->wq_write, EPOLLOUT | EPOLLWRNORM);
+
+	return copied ? copied : -EFAULT;
 }
 
+static __poll_t my_dev_poll(struct file *file, poll_table *wait)
+{
+	struct list_file *lf = file->private_data;
+	struct list_priv *priv = lf->priv;
+	__poll_t mask = 0;
+	u32 used;
+
+	poll_wait(file, &priv->wq_read, wait);
+	poll_wait(file, &priv->wq_write, wait);
+
+	if (priv->broadcast) {
+		if (READ_ONCE(priv->ring->head) != READ_ONCE(lf->cur.pos))
+			mask |= EPOLLIN | EPOLLRDNORM;
+		return mask | EPOLLOUT | EPOLLWRNORM;
+	}
+
+	used = list_used(priv);
+	if (used > READ_ONCE(priv->capacity))
+		return EPOLLERR;
+	if (used)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (used < READ_ONCE(priv->capacity))
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static void list_vm_open(struct vm_area_struct *vma)
+{
+	struct list_priv *priv = vma->vm_private_data;
+
+	atomic_inc(&priv->nr_maps);
+}
+
+static void list_vm_close(struct vm_area_struct *vma)
+{
+	struct list_priv *priv = vma->vm_private_data;
+
+	atomic_dec(&priv->nr_maps);
+}
+
+static const struct vm_operations_struct list_vm_ops = {
+	.open = list_vm_open,
+	.close = list_vm_close,
+};
+
+/*
+ * Map the control page and the payload, io_uring style, so a process can
+ * produce or consume in place and only come back for LIST_IOC_NOTIFY.
+ * The node array past the payload is never handed out.
+ */
+static int my_dev_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct list_file *lf = file->private_data;
+	struct list_priv *priv = lf->priv;
+	unsigned long pages = vma_pages(vma);
+	unsigned long max_pages;
+	int ret;
+
+	mutex_lock(&priv->write_lock);
+	mutex_lock(&priv->read_lock);
+
+	/* borrowed blocks have to go before positions map onto the arena */
+	if (!priv->linear) {
+		if (list_used(priv)) {
+			ret = -EBUSY;
+			goto out;
+		}
+		list_reset(priv);
+	}
+
+	max_pages = priv->map_size >> PAGE_SHIFT;
+	if (!is_power_of_2(priv->capacity) || vma->vm_pgoff >= max_pages ||
+	    pages > max_pages - vma->vm_pgoff) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = remap_vmalloc_range(vma, priv->arena, vma->vm_pgoff);
+	if (ret)
+		goto out;
+
+	vma->vm_private_data = priv;
+	vma->vm_ops = &list_vm_ops;
+	list_vm_open(vma);
+out:
+	mutex_unlock(&priv->read_lock);
+	mutex_unlock(&priv->write_lock);
+	return ret;
+}
+
+static long my_dev_ioctl(struct file *file, unsigned int cmd,
+			 unsigned long arg)
+{
+	struct list_file *lf = file->private_data;
+	struct list_priv *priv = lf->priv;
+
+	switch (cmd) {
+	case LIST_IOC_NOTIFY:
+		list_wake(&priv->wq_read, EPOLLIN | EPOLLRDNORM);
+		list_wake(&priv->wq_write, EPOLLOUT | EPOLLWRNORM);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* a broadcast reader starts with whatever is written after it opened */
 static int my_dev_open(struct inode *inode, struct file *file)
 {
+	struct list_priv *priv = container_of(file->private_data,
+					      struct list_priv,
+					      list_miscdevice);
+	struct list_file *lf;
+
 	pr_info("my_dev_open() is called.\n");
-	return 0;
+
+	lf = kzalloc(sizeof(*lf), GFP_KERNEL);
+	if (!lf)
+		return -ENOMEM;
+	lf->priv = priv;
+	mutex_init(&lf->lock);
+
+	mutex_lock(&priv->read_lock);
+	atomic_inc(&priv->nr_open);
+	if (priv->broadcast)
+		list_cursor_seek(priv, &lf->cur, READ_ONCE(priv->ring->head));
+	mutex_unlock(&priv->read_lock);
+
+	file->private_data = lf;
+	return stream_open(inode, file);
 }
 static int my_dev_close(struct inode *inode, struct file *file)
 {
+	struct list_file *lf = file->private_data;
+
 	pr_info("my_dev_close() is called.\n");
+	atomic_dec(&lf->priv->nr_open);
+	kfree(lf);
 	return 0;
 }
 
+/*
+ * splice() and sendfile() go through the iter paths, copying between the
+ * ring and the pipe pages with no user buffer in between. Lending the
+ * ring pages to the pipe instead would pin them until the pipe reader
+ * got round to them, which a ring that keeps reusing its blocks cannot
+ * allow.
+ */
 static const struct file_operations my_dev_fops = {
 	.owner = THIS_MODULE,
 	.open = my_dev_open,
-	.write = my_dev_write,
-	.read = my_dev_read,
+	.write_iter = my_dev_write_iter,
+	.read_iter = my_dev_read_iter,
+	.poll = my_dev_poll,
+	.mmap = my_dev_mmap,
+	.unlocked_ioctl = my_dev_ioctl,
+	.compat_ioctl = compat_ptr_ioctl,
+	.splice_read = generic_file_splice_read,
+	.splice_write = iter_file_splice_write,
 	.release = my_dev_close,
 };
 
-static struct miscdevice helloworld_miscdevice = {
-	.minor = MISC_DYNAMIC_MINOR,
-	.name = "mydev",
-	.fops = &my_dev_fops,
+static unsigned long list_shrink_count(struct shrinker *shrinker,
+				       struct shrink_control *sc)
+{
+	struct list_priv *priv = container_of(shrinker, struct list_priv,
+					      shrinker);
+	unsigned int nr = READ_ONCE(priv->nr_extra);
+
+	return nr ? nr : SHRINK_EMPTY;
+}
+
+/*
+ * Free borrowed blocks lying wholly in the empty stretch between the
+ * writer and the reader. Neither cursor's own block is touched, and
+ * neither side can walk into the stretch while both locks are held.
+ */
+static unsigned long list_shrink_scan(struct shrinker *shrinker,
+				      struct shrink_control *sc)
+{
+	struct list_priv *priv = container_of(shrinker, struct list_priv,
+					      shrinker);
+	data_node *node, *stop;
+	unsigned long freed = 0;
+
+	if (!mutex_trylock(&priv->write_lock))
+		return SHRINK_STOP;
+	if (!mutex_trylock(&priv->read_lock)) {
+		mutex_unlock(&priv->write_lock);
+		return SHRINK_STOP;
+	}
+
+	node = priv->wr_cur.node;
+	stop = priv->rd_cur.node;
+	/* both in one block with data wrapping all the way round */
+	if (stop == node && list_used(priv) >= priv->block_size)
+		goto out;
+
+	while (freed < sc->nr_to_scan && node->next != stop &&
+	       node->next != priv->wr_cur.node) {
+		if (list_node_extra(priv, node->next)) {
+			list_drop_next(priv, node);
+			freed++;
+		} else {
+			node = node->next;
+		}
+	}
+out:
+	mutex_unlock(&priv->read_lock);
+	mutex_unlock(&priv->write_lock);
+	return freed;
+}
+
+static struct list_priv *to_list_priv(struct device *dev)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+
+	return container_of(misc, struct list_priv, list_miscdevice);
+}
+
+static ssize_t block_size_show(struct device *dev,
+			       struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(to_list_priv(dev)->block_size));
+}
+
+/* writing either geometry attribute rebuilds the list, which must be closed */
+static ssize_t block_size_store(struct device *dev,
+				struct device_attribute *attr, const char *buf,
+				size_t count)
+{
+	struct list_priv *priv = to_list_priv(dev);
+	unsigned int size;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &size);
+	if (ret)
+		return ret;
+
+	ret = list_resize(priv, size, READ_ONCE(priv->block_count));
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(block_size);
+
+static ssize_t block_count_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n",
+			  READ_ONCE(to_list_priv(dev)->block_count));
+}
+
+static ssize_t block_count_store(struct device *dev,
+				 struct device_attribute *attr,
+				 const char *buf, size_t count)
+{
+	struct list_priv *priv = to_list_priv(dev);
+	unsigned int nr;
+	int ret;
+
+	ret = kstrtouint(buf, 0, &nr);
+	if (ret)
+		return ret;
+
+	ret = list_resize(priv, READ_ONCE(priv->block_size), nr);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(block_count);
+
+static ssize_t broadcast_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%d\n", READ_ONCE(to_list_priv(dev)->broadcast));
+}
+
+static ssize_t broadcast_store(struct device *dev,
+			       struct device_attribute *attr, const char *buf,
+			       size_t count)
+{
+	bool on;
+	int ret;
+
+	ret = kstrtobool(buf, &on);
+	if (ret)
+		return ret;
+
+	ret = list_set_broadcast(to_list_priv(dev), on);
+	return ret ? ret : count;
+}
+static DEVICE_ATTR_RW(broadcast);
+
+/* bytes held by the arena and borrowed blocks, now and at most so far */
+static ssize_t footprint_show(struct device *dev,
+			      struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%zu\n",
+			  READ_ONCE(to_list_priv(dev)->footprint));
+}
+static DEVICE_ATTR_RO(footprint);
+
+static ssize_t peak_footprint_show(struct device *dev,
+				   struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%zu\n",
+			  READ_ONCE(to_list_priv(dev)->peak_footprint));
+}
+static DEVICE_ATTR_RO(peak_footprint);
+
+static ssize_t capacity_show(struct device *dev,
+			     struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%zu\n", READ_ONCE(to_list_priv(dev)->capacity));
+}
+static DEVICE_ATTR_RO(capacity);
+
+static struct attribute *list_attrs[] = {
+	&dev_attr_block_size.attr,
+	&dev_attr_block_count.attr,
+	&dev_attr_capacity.attr,
+	&dev_attr_broadcast.attr,
+	&dev_attr_footprint.attr,
+	&dev_attr_peak_footprint.attr,
+	NULL,
 };
 
+ATTRIBUTE_GROUPS(list);
+
 static int my_probe(struct platform_device *pdev)
 {
+	struct list_priv *priv;
+	struct kmem_cache *cache;
+	void *arena;
 	int ret_val;
 	pr_info("platform_probe enter\n");
-	createlist(pdev);
-	ret_val = misc_register(&helloworld_miscdevice);
+
+	priv = devm_kzalloc(&pdev->dev, sizeof(*priv), GFP_KERNEL);
+	if (!priv)
+		return -ENOMEM;
+	priv->dev = &pdev->dev;
+	mutex_init(&priv->write_lock);
+	mutex_init(&priv->read_lock);
+	atomic_set(&priv->nr_maps, 0);
+	atomic_set(&priv->nr_open, 0);
+	priv->broadcast = broadcast;
+	init_waitqueue_head(&priv->wq_write);
+	init_waitqueue_head(&priv->wq_read);
+
+	if (broadcast && !is_power_of_2((size_t)block_size * block_count)) {
+		dev_err(&pdev->dev,
+			"broadcast needs a power-of-two capacity\n");
+		return -EINVAL;
+	}
+
+	arena = createlist(block_size, block_count);
+	if (!arena) {
+		dev_err(&pdev->dev, "cannot allocate %u blocks of %u bytes\n",
+			block_count, block_size);
+		return -ENOMEM;
+	}
+	cache = list_cache_create(block_size);
+	if (!cache) {
+		vfree(arena);
+		return -ENOMEM;
+	}
+	list_install(priv, arena, cache, block_size, block_count);
+
+	priv->shrinker.count_objects = list_shrink_count;
+	priv->shrinker.scan_objects = list_shrink_scan;
+	priv->shrinker.seeks = DEFAULT_SEEKS;
+	ret_val = register_shrinker(&priv->shrinker, "linkedmem-%s",
+				    dev_name(&pdev->dev));
+	if (ret_val)
+		goto err_free;
+
+	priv->list_miscdevice.minor = MISC_DYNAMIC_MINOR;
+	priv->list_miscdevice.name = "mydev";
+	priv->list_miscdevice.fops = &my_dev_fops;
+	priv->list_miscdevice.groups = list_groups;
+
+	ret_val = misc_register(&priv->list_miscdevice);
 	if (ret_val != 0) {
 		pr_err("could not register the misc device mydev");
-		return ret_val;
+		goto err_shrinker;
 	}
-	pr_info("mydev: got minor %i\n", helloworld_miscdevice.minor);
+	platform_set_drvdata(pdev, priv);
+	pr_info("mydev: got minor %i\n", priv->list_miscdevice.minor);
 
 	return 0;
+
+err_shrinker:
+	unregister_shrinker(&priv->shrinker);
+err_free:
+	kmem_cache_destroy(priv->block_cache);
+	vfree(priv->arena);
+	return ret_val;
 }
 static int my_remove(struct platform_device *pdev)
 {
-	misc_deregister(&helloworld_miscdevice);
+	struct list_priv *priv = platform_get_drvdata(pdev);
+
+	misc_deregister(&priv->list_miscdevice);
+	unregister_shrinker(&priv->shrinker);
+	list_free_extra(priv);
+	kmem_cache_destroy(priv->block_cache);
+	vfree(priv->arena);
 	pr_info("platform_remove exit\n");
 	return 0;
 }
-
 static const struct of_device_id my_of_ids[] = {
 	{ .compatible = "arrow,memory" },
 	{},
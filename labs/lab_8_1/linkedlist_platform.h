@@ -0,0 +1,54 @@
+#ifndef LINKEDLIST_PLATFORM_H
+#define LINKEDLIST_PLATFORM_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Control page, mapped at offset 0 of /dev/mydev. head counts every byte
+ * ever produced and tail every byte consumed, both modulo 2^32, so head -
+ * tail is the amount of queued data. The byte at ring position p lives at
+ * data_offset + (p & (capacity - 1)) in the same mapping.
+ *
+ * A producer stores its data, then head with release semantics; a
+ * consumer loads head with acquire semantics, reads, then stores tail with
+ * release semantics. read() and write() on the device use the same two
+ * indices, so mapped and unmapped users can sit on either side of the
+ * ring. head and tail live on separate cache lines.
+ *
+ * With LIST_RING_BROADCAST set in flags, tail is instead the oldest byte
+ * not yet overwritten and every consumer keeps its own position. The
+ * producer never waits: before storing bytes that overwrite old data it
+ * moves tail past them, then issues a write barrier. A consumer copies,
+ * issues a read barrier and checks tail again; if tail has passed the
+ * position it started from, the copy may be torn and it has been
+ * overrun, which read() reports as -EOVERFLOW.
+ *
+ * The ring can only be mapped while capacity is a power of two, and
+ * cannot be resized while it is open or mapped. map_size is the length to
+ * pass to mmap() to cover the control page and all the data.
+ */
+struct list_ring {
+	__u32 head;
+	__u32 pad0[15];
+	__u32 tail;
+	__u32 pad1[15];
+	__u32 capacity;
+	__u32 block_size;
+	__u32 block_count;
+	__u32 data_offset;
+	__u32 map_size;
+	__u32 flags;
+};
+
+#define LIST_RING_BROADCAST (1 << 0)
+
+#define LIST_IOC_MAGIC 'L'
+
+/*
+ * Wake readers and writers sleeping in the driver, including poll(),
+ * after moving head or tail through the mapping.
+ */
+#define LIST_IOC_NOTIFY _IO(LIST_IOC_MAGIC, 0)
+
+#endif /* LINKEDLIST_PLATFORM_H */
@@ -6,100 +6,2578 @@
 #include <linux/miscdevice.h>
 #include <linux/platform_device.h>
 #include <linux/of_device.h>
+#include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/sched.h>
+#include <linux/scatterlist.h>
+#include <linux/property.h>
+#include <linux/sizes.h>
+#include <linux/ktime.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-resv.h>
+
+#include "sdma_m2m.h"
+
+static unsigned int queue_depth = 64;
+module_param(queue_depth, uint, S_IRUGO);
+MODULE_PARM_DESC(queue_depth,
+		 "Maximum number of unreaped async requests per open file");
+
+#define SDMA_BUF_SIZE 4096
+
+static unsigned int pool_buffers = 8;
+module_param(pool_buffers, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_buffers, "Number of pre-mapped write() buffer pairs");
+
+static unsigned int pool_buffer_size = SDMA_BUF_SIZE;
+module_param(pool_buffer_size, uint, S_IRUGO);
+MODULE_PARM_DESC(pool_buffer_size, "Size in bytes of each pool buffer");
+
+static unsigned int nr_channels = 1;
+module_param(nr_channels, uint, S_IRUGO);
+MODULE_PARM_DESC(nr_channels, "Number of memcpy channels to stripe over");
+
+static unsigned int stripe_min = SZ_256K;
+module_param(stripe_min, uint, S_IRUGO);
+MODULE_PARM_DESC(stripe_min, "Smallest copy split across all channels");
+
+static unsigned int mmap_size = SZ_1M;
+module_param(mmap_size, uint, S_IRUGO);
+MODULE_PARM_DESC(mmap_size,
+		 "Size in bytes of each open file's mmap() coherent buffer");
+
+/*
+ * Source/destination pair used by write(). Both halves are mapped once at
+ * probe time and only the bytes actually used are synced per request.
+ */
+struct sdma_pool_buf {
+	struct list_head node;
+	void *src;
+	void *dst;
+	dma_addr_t src_dma;
+	dma_addr_t dst_dma;
+};
+
+#define SDMA_MAX_CHANNELS 8
+
+/* Copy sizes measured at probe, doubling from 64 bytes up to 64 KiB */
+#define SDMA_CAL_MIN 64
+#define SDMA_CAL_CLASSES 11
+#define SDMA_CAL_ROUNDS 8
+
+/*
+ * Ways a copy can go, each with its own costs on both sides and so its
+ * own CPU threshold: write() through the pre-mapped pool, user buffers
+ * that are pinned and mapped per request, or bounced through the kernel
+ * when the CPU copies, and kicks on the uncached mmap() buffer.
+ */
+enum sdma_path {
+	SDMA_PATH_POOL,
+	SDMA_PATH_USER,
+	SDMA_PATH_COHERENT,
+	SDMA_NR_PATHS,
+};
+
+static const char *const sdma_path_names[SDMA_NR_PATHS] = {
+	"pool", "user", "coherent"
+};
+
+/* A memcpy channel and the bytes currently queued on it */
+struct sdma_chan {
+	struct dma_chan *chan;
+	atomic_long_t inflight;
+	atomic64_t bytes;
+};
 
 struct dma_private {
 	struct miscdevice dma_misc_device;
 	struct device *dev;
-	char *wbuf;
-	char *rbuf;
+	/* first channel, all others belong to the same DMA device */
 	struct dma_chan *dma_m2m_chan;
-	struct completion dma_m2m_ok;
+	struct sdma_chan chans[SDMA_MAX_CHANNELS];
+	unsigned int nr_chans;
+	atomic_t next_chan;
+	struct sdma_pool_buf *pool;
+	unsigned int pool_count;
+	size_t pool_buf_size;
+	spinlock_t pool_lock; /* protects pool_free */
+	struct list_head pool_free;
+	wait_queue_head_t wq_pool;
+	size_t mmap_size;
+	size_t max_chunk;
+	size_t copy_align;
+	size_t fill_align;
+	bool has_memset;
+	/* per path, copies shorter than this skip the engine */
+	size_t cpu_threshold[SDMA_NR_PATHS];
+	unsigned int nr_cal[SDMA_NR_PATHS];
+	u64 cal_dma_ns[SDMA_NR_PATHS][SDMA_CAL_CLASSES];
+	u64 cal_cpu_ns[SDMA_NR_PATHS][SDMA_CAL_CLASSES];
+	atomic_t nr_ctx;
+	wait_queue_head_t wq_ctx;
+};
+
+/*
+ * State of one open file: its own completion ring and mmap() buffer. All
+ * contexts share the device's channels and write() pool.
+ */
+struct sdma_ctx {
+	struct dma_private *dma_priv;
+	spinlock_t req_lock; /* protects done_list, nr_queued and nr_done */
+	struct list_head done_list;
+	unsigned int nr_queued;
+	unsigned int nr_done;
+	wait_queue_head_t wq_done;
+	atomic64_t next_cookie;
+	struct mutex mmap_lock; /* serializes allocating mmap_buf */
+	void *mmap_buf; /* allocated on first mmap() */
+	dma_addr_t mmap_dma;
+};
+
+/* Pinned user space buffer or imported dma-buf, mapped for the engine */
+struct sdma_user_buf {
+	struct page **pages;
+	int nr_pages;
+	struct sg_append_table sgt;
+	enum dma_data_direction dir;
+	struct sg_table *table; /* sgt or the dma-buf's mapping */
+	size_t skip; /* bytes of table in front of the copy */
+	struct dma_buf_attachment *attach;
+};
+
+/*
+ * Buffer handed out as a dma-buf, lives as long as its file. Its pages are
+ * ordinary cached memory, so every attachment is tracked to bracket CPU
+ * access through DMA_BUF_IOCTL_SYNC with cache maintenance for each device
+ * that has it mapped.
+ */
+struct sdma_dmabuf {
+	struct page **pages;
+	unsigned int nr_pages;
+	struct mutex lock; /* protects attachments */
+	struct list_head attachments;
+};
+
+struct sdma_dmabuf_attachment {
+	struct list_head node;
+	struct device *dev;
+	struct sg_table sgt;
+	bool mapped;
+};
+
+struct sdma_req;
+
+/* The share of a request that runs on one channel */
+struct sdma_req_part {
+	struct sdma_req *req;
+	struct sdma_chan *schan;
+	size_t end; /* request offset the part stops at */
+	size_t queued;
+	dma_cookie_t cookie; /* last descriptor queued for the part */
+};
+
+/*
+ * One copy in flight, owns its own completion. pending holds one reference
+ * for the submitter plus one per part whose last descriptor is queued. Jobs
+ * of a batch take their references on a leader request which collects them
+ * on its batch list and completes once the last of them has finished.
+ */
+struct sdma_req {
+	struct list_head node;
+	struct list_head batch;
+	struct sdma_req *leader;
+	atomic_t pending;
+	struct dma_private *dma_priv;
+	struct sdma_ctx *ctx;
+	struct sdma_user_buf src;
+	struct sdma_user_buf dst;
+	dma_addr_t src_dma; /* requests on the mmap() buffer */
+	dma_addr_t dst_dma;
+	bool cpu; /* copied by sdma_req_cpu_copy() instead */
+	struct sdma_iovec cpu_iov;
+	struct sdma_iovec *iov; /* gathered into or scattered from uaddr */
+	unsigned int nr_iov;
+	bool scatter;
+	u64 uaddr;
+	void *src_buf;
+	void *dst_buf;
+	bool fill; /* memset dst to value, there is no source */
+	u8 value;
+	size_t len;
+	size_t queued;
+	unsigned int nr_parts;
+	unsigned int cur_part;
+	unsigned int nr_tails;
+	struct sdma_req_part parts[SDMA_MAX_CHANNELS];
+	struct completion done;
+	bool async;
+	int status;
+	u64 cookie;
+	u64 user_data;
+};
+
+static void sdma_issue_pending(struct dma_private *dma_priv)
+{
+	unsigned int i;
+
+	for (i = 0; i < dma_priv->nr_chans; i++)
+		dma_async_issue_pending(dma_priv->chans[i].chan);
+}
+
+/*
+ * Least loaded channel by bytes in flight. The scan starts one channel
+ * further each time so equally loaded channels are used round-robin.
+ */
+static struct sdma_chan *sdma_pick_chan(struct dma_private *dma_priv)
+{
+	unsigned int start = atomic_inc_return(&dma_priv->next_chan);
+	struct sdma_chan *best = NULL;
+	struct sdma_chan *schan;
+	long load, best_load = 0;
+	unsigned int i;
+
+	for (i = 0; i < dma_priv->nr_chans; i++) {
+		schan = &dma_priv->chans[(start + i) % dma_priv->nr_chans];
+		load = atomic_long_read(&schan->inflight);
+		if (!best || load < best_load) {
+			best = schan;
+			best_load = load;
+		}
+	}
+
+	return best;
+}
+
+static bool sdma_use_cpu(struct dma_private *dma_priv, enum sdma_path path,
+			 size_t len)
+{
+	return len < READ_ONCE(dma_priv->cpu_threshold[path]);
+}
+
+static struct sdma_pool_buf *sdma_pool_try_get(struct dma_private *dma_priv)
+{
+	struct sdma_pool_buf *pbuf;
+
+	spin_lock(&dma_priv->pool_lock);
+	pbuf = list_first_entry_or_null(&dma_priv->pool_free,
+					struct sdma_pool_buf, node);
+	if (pbuf)
+		list_del(&pbuf->node);
+	spin_unlock(&dma_priv->pool_lock);
+
+	return pbuf;
+}
+
+/* Take a buffer pair from the pool, sleeping until one is recycled */
+static struct sdma_pool_buf *sdma_pool_get(struct dma_private *dma_priv)
+{
+	struct sdma_pool_buf *pbuf = NULL;
+	int ret;
+
+	ret = wait_event_interruptible(dma_priv->wq_pool,
+				       (pbuf = sdma_pool_try_get(dma_priv)));
+	if (ret)
+		return ERR_PTR(ret);
+
+	return pbuf;
+}
+
+static void sdma_pool_put(struct dma_private *dma_priv,
+			  struct sdma_pool_buf *pbuf)
+{
+	/* LIFO keeps the most recently used, cache warm, buffer on top */
+	spin_lock(&dma_priv->pool_lock);
+	list_add(&pbuf->node, &dma_priv->pool_free);
+	spin_unlock(&dma_priv->pool_lock);
+
+	wake_up(&dma_priv->wq_pool);
+}
+
+static void sdma_pool_destroy(struct dma_private *dma_priv)
+{
+	struct device *dma_dev;
+	struct sdma_pool_buf *pbuf;
+	unsigned int i;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+	for (i = 0; i < dma_priv->pool_count; i++) {
+		pbuf = &dma_priv->pool[i];
+		dma_unmap_single(dma_dev, pbuf->src_dma,
+				 dma_priv->pool_buf_size, DMA_TO_DEVICE);
+		dma_unmap_single(dma_dev, pbuf->dst_dma,
+				 dma_priv->pool_buf_size, DMA_FROM_DEVICE);
+	}
+	dma_priv->pool_count = 0;
+}
+
+/*
+ * Allocate and map the write() buffer pool. The "arrow,pool-buffers" and
+ * "arrow,pool-buffer-size" device tree properties override the module
+ * parameters.
+ */
+static int sdma_pool_create(struct dma_private *dma_priv)
+{
+	struct device *dev = dma_priv->dev;
+	struct sdma_pool_buf *pbuf;
+	struct device *dma_dev;
+	u32 nr = pool_buffers;
+	u32 size = pool_buffer_size;
+	unsigned int i;
+
+	device_property_read_u32(dev, "arrow,pool-buffers", &nr);
+	device_property_read_u32(dev, "arrow,pool-buffer-size", &size);
+	if (!nr || !size)
+		return -EINVAL;
+
+	dma_priv->pool = devm_kcalloc(dev, nr, sizeof(*pbuf), GFP_KERNEL);
+	if (!dma_priv->pool)
+		return -ENOMEM;
+
+	/* write() rounds its transfers up to the copy alignment */
+	size = ALIGN(size, dma_priv->copy_align);
+	dma_priv->pool_buf_size = size;
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+
+	for (i = 0; i < nr; i++) {
+		pbuf = &dma_priv->pool[i];
+		pbuf->src = devm_kzalloc(dev, size, GFP_KERNEL);
+		pbuf->dst = devm_kzalloc(dev, size, GFP_KERNEL);
+		if (!pbuf->src || !pbuf->dst)
+			goto err;
+
+		pbuf->src_dma = dma_map_single(dma_dev, pbuf->src, size,
+					       DMA_TO_DEVICE);
+		if (dma_mapping_error(dma_dev, pbuf->src_dma))
+			goto err;
+
+		pbuf->dst_dma = dma_map_single(dma_dev, pbuf->dst, size,
+					       DMA_FROM_DEVICE);
+		if (dma_mapping_error(dma_dev, pbuf->dst_dma)) {
+			dma_unmap_single(dma_dev, pbuf->src_dma, size,
+					 DMA_TO_DEVICE);
+			goto err;
+		}
+
+		list_add_tail(&pbuf->node, &dma_priv->pool_free);
+		dma_priv->pool_count++;
+	}
+
+	dev_info(dev, "pool of %u x %u byte buffer pairs mapped\n", nr, size);
+
+	return 0;
+
+err:
+	dev_err(dev, "error allocating pool buffer %u !!\n", i);
+	sdma_pool_destroy(dma_priv);
+	return -ENOMEM;
+}
+
+/*
+ * Size of the mmap() buffer of each context. The "arrow,mmap-size" device
+ * tree property overrides the module parameter.
+ */
+static int sdma_mmap_init(struct dma_private *dma_priv)
+{
+	u32 size = mmap_size;
+
+	device_property_read_u32(dma_priv->dev, "arrow,mmap-size", &size);
+	if (!size)
+		return -EINVAL;
+
+	dma_priv->mmap_size = PAGE_ALIGN(size);
+	return 0;
+}
+
+/* Allocate the coherent buffer user space maps to produce data in place */
+static int sdma_mmap_buf_create(struct sdma_ctx *ctx)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct device *dma_dev;
+	void *buf;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+	buf = dma_alloc_coherent(dma_dev, dma_priv->mmap_size, &ctx->mmap_dma,
+				 GFP_KERNEL);
+	if (!buf) {
+		dev_err(dma_priv->dev, "error allocating mmap buffer !!\n");
+		return -ENOMEM;
+	}
+
+	/* Pairs with the acquire in sdma_ioctl_kick() */
+	smp_store_release(&ctx->mmap_buf, buf);
+	return 0;
+}
+
+static void sdma_mmap_buf_destroy(struct sdma_ctx *ctx)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct device *dma_dev;
+
+	if (!ctx->mmap_buf)
+		return;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+	dma_free_coherent(dma_dev, dma_priv->mmap_size, ctx->mmap_buf,
+			  ctx->mmap_dma);
+}
+
+static void dma_m2m_callback(void *data)
+{
+	struct completion *done = data;
+	pr_debug("%s: finished DMA transaction\n", __func__);
+
+	/* done lives on the writer's stack, do not touch it after this */
+	complete(done);
+}
+
+/* One pool buffer pair in flight on behalf of write() */
+struct sdma_write_chunk {
+	struct completion done;
+	struct sdma_pool_buf *pbuf;
+	struct sdma_chan *schan;
+	dma_cookie_t cookie;
+	size_t len;
+};
+
+static int sdma_write_chunk_start(struct dma_private *dma_priv,
+				  struct sdma_write_chunk *chunk,
+				  const char __user *buf, size_t len)
+{
+	struct dma_async_tx_descriptor *dma_m2m_desc;
+	struct sdma_pool_buf *pbuf = chunk->pbuf;
+	struct device *dma_dev;
+	size_t dma_len;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+
+	if (copy_from_user(pbuf->src, buf, len))
+		return -EFAULT;
+
+	chunk->len = len;
+	if (sdma_use_cpu(dma_priv, SDMA_PATH_POOL, len)) {
+		memcpy(pbuf->dst, pbuf->src, len);
+		chunk->schan = NULL;
+		return 0;
+	}
+
+	/*
+	 * Round the transfer up to the engine's copy alignment, the pool
+	 * buffers are sized for it and the tail is never looked at.
+	 */
+	dma_len = ALIGN(len, dma_priv->copy_align);
+
+	/* Only the bytes written need cache maintenance */
+	dma_sync_single_for_device(dma_dev, pbuf->src_dma, dma_len,
+				   DMA_TO_DEVICE);
+	dma_sync_single_for_device(dma_dev, pbuf->dst_dma, dma_len,
+				   DMA_FROM_DEVICE);
+
+	chunk->schan = sdma_pick_chan(dma_priv);
+	dma_m2m_desc = dmaengine_prep_dma_memcpy(
+		chunk->schan->chan, pbuf->dst_dma, pbuf->src_dma, dma_len,
+		DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+	if (!dma_m2m_desc) {
+		dev_err(dma_priv->dev, "Failed to obtain DMA descriptor\n");
+		return -ENOMEM;
+	}
+
+	init_completion(&chunk->done);
+	dma_m2m_desc->callback = dma_m2m_callback;
+	dma_m2m_desc->callback_param = &chunk->done;
+
+	chunk->cookie = dmaengine_submit(dma_m2m_desc);
+
+	if (dma_submit_error(chunk->cookie)) {
+		dev_err(dma_priv->dev, "Failed to submit DMA\n");
+		return -EINVAL;
+	};
+	atomic_long_add(dma_len, &chunk->schan->inflight);
+	dma_async_issue_pending(chunk->schan->chan);
+
+	return 0;
+}
+
+static int sdma_write_chunk_finish(struct dma_private *dma_priv,
+				   struct sdma_write_chunk *chunk)
+{
+	struct sdma_pool_buf *pbuf = chunk->pbuf;
+	struct device *dma_dev;
+	size_t dma_len;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+
+	/* Copied by the CPU already */
+	if (!chunk->schan)
+		goto check;
+
+	wait_for_completion(&chunk->done);
+
+	dma_len = ALIGN(chunk->len, dma_priv->copy_align);
+	atomic_long_sub(dma_len, &chunk->schan->inflight);
+	atomic64_add(dma_len, &chunk->schan->bytes);
+
+	dma_sync_single_for_cpu(dma_dev, pbuf->dst_dma, dma_len,
+				DMA_FROM_DEVICE);
+
+	if (dma_async_is_tx_complete(chunk->schan->chan, chunk->cookie, NULL,
+				     NULL) != DMA_COMPLETE)
+		goto err;
+
+check:
+	if (*(char *)pbuf->dst != *(char *)pbuf->src)
+		goto err;
+
+	return 0;
+
+err:
+	dev_err(dma_priv->dev, "buffer copy failed!\n");
+	return -EIO;
+}
+
+/*
+ * Copy count bytes through the pool, one buffer pair at a time. The next
+ * chunk is filled from user space while the previous one is still on the
+ * engine. The return value covers only the leading chunks that completed.
+ */
+static ssize_t sdma_write(struct file *file, const char __user *buf,
+			  size_t count, loff_t *offset)
+{
+	struct sdma_write_chunk chunks[2];
+	struct sdma_write_chunk *prev = NULL;
+	struct sdma_write_chunk *cur;
+	struct sdma_ctx *ctx = file->private_data;
+	struct dma_private *dma_priv = ctx->dma_priv;
+	size_t queued = 0, done = 0;
+	unsigned int i = 0;
+	bool ok = true;
+	size_t chunk_max;
+	int ret = 0;
+	int err;
+
+	chunk_max = min_t(size_t, dma_priv->pool_buf_size,
+			  dma_priv->max_chunk);
+
+	while (queued < count) {
+		cur = &chunks[i];
+
+		/* Reuse the in-flight pair when the pool has none to spare */
+		cur->pbuf = prev ? sdma_pool_try_get(dma_priv) :
+				   sdma_pool_get(dma_priv);
+		if (IS_ERR(cur->pbuf)) {
+			ret = PTR_ERR(cur->pbuf);
+			break;
+		}
+		if (!cur->pbuf) {
+			err = sdma_write_chunk_finish(dma_priv, prev);
+			ok = ok && !err;
+			if (ok)
+				done += prev->len;
+			cur->pbuf = prev->pbuf;
+			prev = NULL;
+			if (err) {
+				sdma_pool_put(dma_priv, cur->pbuf);
+				ret = err;
+				break;
+			}
+		}
+
+		ret = sdma_write_chunk_start(dma_priv, cur, buf + queued,
+					     min(count - queued, chunk_max));
+		if (ret) {
+			sdma_pool_put(dma_priv, cur->pbuf);
+			break;
+		}
+		queued += cur->len;
+
+		if (prev) {
+			err = sdma_write_chunk_finish(dma_priv, prev);
+			sdma_pool_put(dma_priv, prev->pbuf);
+			ok = ok && !err;
+			if (ok)
+				done += prev->len;
+			else
+				ret = err;
+		}
+
+		prev = cur;
+		i ^= 1;
+		if (!ok)
+			break;
+	}
+
+	/* Drain the chunk still on the engine */
+	if (prev) {
+		err = sdma_write_chunk_finish(dma_priv, prev);
+		sdma_pool_put(dma_priv, prev->pbuf);
+		ok = ok && !err;
+		if (ok)
+			done += prev->len;
+		else if (!ret)
+			ret = err;
+	}
+
+	return done ? (ssize_t)done : ret;
+}
+
+static void sdma_release_buf(struct dma_private *dma_priv,
+			     struct sdma_user_buf *ubuf)
+{
+	struct dma_buf *dmabuf;
+	struct device *dma_dev;
+
+	if (ubuf->attach) {
+		dmabuf = ubuf->attach->dmabuf;
+		dma_buf_unmap_attachment(ubuf->attach, ubuf->table, ubuf->dir);
+		dma_buf_detach(dmabuf, ubuf->attach);
+		dma_buf_put(dmabuf);
+		return;
+	}
+
+	/* requests on the mmap() buffer have nothing pinned */
+	if (!ubuf->pages)
+		return;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+	dma_unmap_sgtable(dma_dev, ubuf->table, ubuf->dir, 0);
+	sg_free_append_table(&ubuf->sgt);
+	if (ubuf->dir == DMA_FROM_DEVICE)
+		unpin_user_pages_dirty_lock(ubuf->pages, ubuf->nr_pages, true);
+	else
+		unpin_user_pages(ubuf->pages, ubuf->nr_pages);
+	kvfree(ubuf->pages);
+}
+
+/*
+ * Pin the ranges of an I/O vector and map them for the DMA engine as one
+ * scatterlist, in vector order. Every path that pins user memory comes
+ * through here, so this is where the length from user space is bounded.
+ */
+static int sdma_pin_user_iov(struct dma_private *dma_priv,
+			     struct sdma_user_buf *ubuf,
+			     const struct sdma_iovec *iov, unsigned int nr_iov,
+			     enum dma_data_direction dir)
+{
+	unsigned int gup_flags = dir == DMA_FROM_DEVICE ? FOLL_WRITE : 0;
+	unsigned int offset, i;
+	struct device *dma_dev;
+	unsigned long total = 0;
+	unsigned long nr_pages;
+	int pinned;
+	int ret;
+
+	for (i = 0; i < nr_iov; i++) {
+		if (iov[i].len > INT_MAX)
+			return -EINVAL;
+		total += DIV_ROUND_UP(offset_in_page(iov[i].base) + iov[i].len,
+				      PAGE_SIZE);
+		if (total > INT_MAX)
+			return -EINVAL;
+	}
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+	ubuf->dir = dir;
+	ubuf->pages = kvmalloc_array(total, sizeof(struct page *),
+				     GFP_KERNEL);
+	if (!ubuf->pages)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_iov; i++) {
+		if (!iov[i].len)
+			continue;
+
+		offset = offset_in_page(iov[i].base);
+		nr_pages = DIV_ROUND_UP(offset + iov[i].len, PAGE_SIZE);
+		pinned = pin_user_pages_fast(iov[i].base & PAGE_MASK, nr_pages,
+					     gup_flags,
+					     ubuf->pages + ubuf->nr_pages);
+		if (pinned < 0) {
+			ret = pinned;
+			goto err_unpin;
+		}
+		ubuf->nr_pages += pinned;
+		if (pinned != nr_pages) {
+			ret = -EFAULT;
+			goto err_unpin;
+		}
+
+		ret = sg_alloc_append_table_from_pages(
+			&ubuf->sgt, ubuf->pages + ubuf->nr_pages - nr_pages,
+			nr_pages, offset, iov[i].len, UINT_MAX,
+			total - ubuf->nr_pages, GFP_KERNEL);
+		if (ret)
+			goto err_unpin;
+	}
+
+	ret = dma_map_sgtable(dma_dev, &ubuf->sgt.sgt, dir, 0);
+	if (ret)
+		goto err_unpin;
+
+	ubuf->table = &ubuf->sgt.sgt;
+	return 0;
+
+err_unpin:
+	sg_free_append_table(&ubuf->sgt);
+	unpin_user_pages(ubuf->pages, ubuf->nr_pages);
+	kvfree(ubuf->pages);
+	ubuf->pages = NULL;
+	ubuf->nr_pages = 0;
+	return ret;
+}
+
+/* Pin [uaddr, uaddr + len) and map it for the DMA engine */
+static int sdma_pin_user_buf(struct dma_private *dma_priv,
+			     struct sdma_user_buf *ubuf, u64 uaddr, u64 len,
+			     enum dma_data_direction dir)
+{
+	struct sdma_iovec iov = { .base = uaddr, .len = len };
+
+	return sdma_pin_user_iov(dma_priv, ubuf, &iov, 1, dir);
+}
+
+/*
+ * Map [off, off + len) of the dma-buf behind fd for the engine. Fences of
+ * earlier users are waited for, no fence is added for the copy itself.
+ */
+static int sdma_import_buf(struct dma_private *dma_priv,
+			   struct sdma_user_buf *ubuf, int fd, u64 off,
+			   size_t len, enum dma_data_direction dir)
+{
+	struct dma_buf *dmabuf;
+	struct device *dma_dev;
+	long lret;
+	int ret;
+
+	dmabuf = dma_buf_get(fd);
+	if (IS_ERR(dmabuf))
+		return PTR_ERR(dmabuf);
+
+	if (off > dmabuf->size || len > dmabuf->size - off) {
+		ret = -EINVAL;
+		goto err_put;
+	}
+
+	/* Readers wait for writers, writers for everybody */
+	lret = dma_resv_wait_timeout(dmabuf->resv,
+				     dma_resv_usage_rw(dir == DMA_FROM_DEVICE),
+				     true, MAX_SCHEDULE_TIMEOUT);
+	if (lret < 0) {
+		ret = lret;
+		goto err_put;
+	}
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+	ubuf->attach = dma_buf_attach(dmabuf, dma_dev);
+	if (IS_ERR(ubuf->attach)) {
+		ret = PTR_ERR(ubuf->attach);
+		goto err_put;
+	}
+
+	ubuf->table = dma_buf_map_attachment(ubuf->attach, dir);
+	if (IS_ERR(ubuf->table)) {
+		ret = PTR_ERR(ubuf->table);
+		goto err_detach;
+	}
+
+	ubuf->dir = dir;
+	ubuf->skip = off;
+	return 0;
+
+err_detach:
+	dma_buf_detach(dmabuf, ubuf->attach);
+err_put:
+	ubuf->attach = NULL;
+	ubuf->table = NULL;
+	dma_buf_put(dmabuf);
+	return ret;
+}
+
+static struct sdma_req *sdma_req_alloc(struct sdma_ctx *ctx, size_t len)
+{
+	struct sdma_req *req;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return NULL;
+
+	req->dma_priv = ctx->dma_priv;
+	req->ctx = ctx;
+	req->len = len;
+	req->leader = req;
+	/* the submitter's reference, see sdma_req_put() */
+	atomic_set(&req->pending, 1);
+	INIT_LIST_HEAD(&req->batch);
+	init_completion(&req->done);
+
+	return req;
+}
+
+/* Allocate a request and pin both of its user buffers */
+static struct sdma_req *sdma_req_create(struct sdma_ctx *ctx, u64 src,
+					u64 dst, u64 len)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct sdma_req *req;
+	int ret;
+
+	if (!len || len > INT_MAX || src + len < src || dst + len < dst)
+		return ERR_PTR(-EINVAL);
+
+	req = sdma_req_alloc(ctx, len);
+	if (!req)
+		return ERR_PTR(-ENOMEM);
+
+	/* Short copies are not worth pinning and mapping */
+	if (sdma_use_cpu(dma_priv, SDMA_PATH_USER, len)) {
+		req->cpu = true;
+		req->cpu_iov.base = src;
+		req->cpu_iov.len = len;
+		req->iov = &req->cpu_iov;
+		req->nr_iov = 1;
+		req->uaddr = dst;
+		return req;
+	}
+
+	ret = sdma_pin_user_buf(dma_priv, &req->src, src, len, DMA_TO_DEVICE);
+	if (ret)
+		goto err_free;
+
+	ret = sdma_pin_user_buf(dma_priv, &req->dst, dst, len,
+				DMA_FROM_DEVICE);
+	if (ret)
+		goto err_src;
+
+	return req;
+
+err_src:
+	sdma_release_buf(dma_priv, &req->src);
+err_free:
+	kfree(req);
+	return ERR_PTR(ret);
+}
+
+static void sdma_req_free(struct sdma_req *req)
+{
+	sdma_release_buf(req->dma_priv, &req->dst);
+	sdma_release_buf(req->dma_priv, &req->src);
+	if (req->iov != &req->cpu_iov)
+		kvfree(req->iov);
+	kfree(req);
+}
+
+/* Release a request together with the batch members it leads */
+static void sdma_req_destroy(struct sdma_req *req)
+{
+	struct sdma_req *job, *tmp;
+
+	list_for_each_entry_safe(job, tmp, &req->batch, node)
+		sdma_req_free(job);
+	sdma_req_free(req);
+}
+
+/* First error of a request or of any job in its batch */
+static int sdma_req_status(struct sdma_req *req)
+{
+	struct sdma_req *job;
+
+	if (req->status)
+		return req->status;
+	list_for_each_entry(job, &req->batch, node)
+		if (job->status)
+			return job->status;
+	return 0;
+}
+
+/* Hand a finished request over to its waiter or to the reap ring */
+static void sdma_req_finish(struct sdma_req *req)
+{
+	struct sdma_ctx *ctx = req->ctx;
+	unsigned long flags;
+
+	if (!req->async) {
+		complete(&req->done);
+		return;
+	}
+
+	/*
+	 * Once on done_list the request belongs to the reaper. The wakeup
+	 * stays under req_lock: as soon as nr_done catches up, release may
+	 * free ctx, and it takes req_lock first to wait for us to let go.
+	 */
+	spin_lock_irqsave(&ctx->req_lock, flags);
+	list_add_tail(&req->node, &ctx->done_list);
+	ctx->nr_done++;
+	wake_up(&ctx->wq_done);
+	spin_unlock_irqrestore(&ctx->req_lock, flags);
+}
+
+static void sdma_req_put(struct sdma_req *req)
+{
+	if (atomic_dec_and_test(&req->pending))
+		sdma_req_finish(req);
+}
+
+static void sdma_req_callback(void *data, const struct dmaengine_result *result)
+{
+	struct sdma_req_part *part = data;
+	struct sdma_req *req = part->req;
+
+	atomic_long_sub(part->queued, &part->schan->inflight);
+	atomic64_add(part->queued, &part->schan->bytes);
+
+	if (result->result != DMA_TRANS_NOERROR)
+		WRITE_ONCE(req->status, -EIO);
+
+	sdma_req_put(req->leader);
+}
+
+/*
+ * Do a request below the CPU threshold, or one the engine has no support
+ * for, in the submitter's context. User buffers go through a bounce buffer
+ * of at most a page, a plain copy is a gather of a single vector.
+ */
+static int sdma_req_cpu_copy(struct sdma_req *req)
+{
+	size_t len = req->len;
+	size_t off = 0, k, n;
+	u64 from, to;
+	void *bounce;
+	unsigned int i;
+	int ret = 0;
+
+	if (req->src_buf) {
+		memcpy(req->dst_buf, req->src_buf, len);
+		return 0;
+	}
+
+	if (req->fill && !req->value)
+		return clear_user(u64_to_user_ptr(req->uaddr), len) ? -EFAULT :
+								       0;
+
+	bounce = kmalloc(min_t(size_t, len, PAGE_SIZE), GFP_KERNEL);
+	if (!bounce)
+		return -ENOMEM;
+
+	if (req->fill) {
+		memset(bounce, req->value, min_t(size_t, len, PAGE_SIZE));
+		for (; off < len && !ret; off += n) {
+			n = min_t(size_t, len - off, PAGE_SIZE);
+			if (copy_to_user(u64_to_user_ptr(req->uaddr + off),
+					 bounce, n))
+				ret = -EFAULT;
+		}
+		goto out;
+	}
+
+	for (i = 0; i < req->nr_iov && !ret; i++) {
+		for (k = 0; k < req->iov[i].len; k += n, off += n) {
+			n = min_t(size_t, req->iov[i].len - k, PAGE_SIZE);
+			from = req->scatter ? req->uaddr + off :
+					      req->iov[i].base + k;
+			to = req->scatter ? req->iov[i].base + k :
+					    req->uaddr + off;
+			if (copy_from_user(bounce, u64_to_user_ptr(from), n) ||
+			    copy_to_user(u64_to_user_ptr(to), bounce, n)) {
+				ret = -EFAULT;
+				break;
+			}
+		}
+	}
+
+out:
+	kfree(bounce);
+	return ret;
+}
+
+static void sdma_cal_callback(void *data)
+{
+	complete(data);
+}
+
+/*
+ * Time one interrupt driven transfer, with the cache maintenance a
+ * streaming mapping needs if sync is set
+ */
+static int sdma_cal_dma(struct dma_private *dma_priv, dma_addr_t src,
+			dma_addr_t dst, size_t len, bool sync, u64 *ns)
+{
+	struct dma_chan *chan = dma_priv->dma_m2m_chan;
+	struct dma_async_tx_descriptor *desc;
+	struct device *dma_dev;
+	struct completion done;
+	u64 start;
+
+	dma_dev = dmaengine_get_dma_device(chan);
+	init_completion(&done);
+	start = ktime_get_ns();
+
+	if (sync) {
+		dma_sync_single_for_device(dma_dev, src, len, DMA_TO_DEVICE);
+		dma_sync_single_for_device(dma_dev, dst, len, DMA_FROM_DEVICE);
+	}
+
+	desc = dmaengine_prep_dma_memcpy(chan, dst, src, len,
+					 DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+	if (!desc)
+		return -ENOMEM;
+
+	desc->callback = sdma_cal_callback;
+	desc->callback_param = &done;
+	if (dma_submit_error(dmaengine_submit(desc)))
+		return -EIO;
+	dma_async_issue_pending(chan);
+
+	if (!wait_for_completion_timeout(&done, msecs_to_jiffies(100))) {
+		/* done lives on our stack, make sure nothing calls back */
+		dmaengine_terminate_sync(chan);
+		return -ETIMEDOUT;
+	}
+
+	if (sync)
+		dma_sync_single_for_cpu(dma_dev, dst, len, DMA_FROM_DEVICE);
+	*ns = ktime_get_ns() - start;
+
+	return 0;
+}
+
+/* Buffers for calibrating every path, each holding two copies of max */
+struct sdma_cal {
+	struct dma_private *dma_priv;
+	size_t max;
+	void *src; /* pool path, streaming mapped */
+	void *dst;
+	dma_addr_t src_dma;
+	dma_addr_t dst_dma;
+	void *coh; /* coherent path */
+	dma_addr_t coh_dma;
+	unsigned long uaddr; /* user path, 0 without a user context */
+	struct sdma_req *req;
+};
+
+/* What a user copy pays on top of the transfer: pin, map and release */
+static int sdma_cal_pin(struct sdma_cal *cal, size_t len, u64 *ns)
+{
+	struct dma_private *dma_priv = cal->dma_priv;
+	struct sdma_user_buf src = {}, dst = {};
+	u64 start;
+	int ret;
+
+	start = ktime_get_ns();
+	ret = sdma_pin_user_buf(dma_priv, &src, cal->uaddr, len,
+				DMA_TO_DEVICE);
+	if (ret)
+		return ret;
+	ret = sdma_pin_user_buf(dma_priv, &dst, cal->uaddr + cal->max, len,
+				DMA_FROM_DEVICE);
+	if (!ret)
+		sdma_release_buf(dma_priv, &dst);
+	sdma_release_buf(dma_priv, &src);
+	*ns = ktime_get_ns() - start;
+
+	return ret;
+}
+
+/* One round of both sides of a path, as the copy paths do them */
+static int sdma_cal_round(struct sdma_cal *cal, enum sdma_path path,
+			  size_t len, u64 *dma_ns, u64 *cpu_ns)
+{
+	struct dma_private *dma_priv = cal->dma_priv;
+	u64 start, ns;
+	int ret;
+
+	switch (path) {
+	case SDMA_PATH_POOL:
+		ret = sdma_cal_dma(dma_priv, cal->src_dma, cal->dst_dma, len,
+				   true, dma_ns);
+		if (ret)
+			return ret;
+		/* The CPU owns dst again after sdma_cal_dma() */
+		start = ktime_get_ns();
+		memcpy(cal->dst, cal->src, len);
+		break;
+	case SDMA_PATH_COHERENT:
+		ret = sdma_cal_dma(dma_priv, cal->coh_dma,
+				   cal->coh_dma + cal->max, len, false, dma_ns);
+		if (ret)
+			return ret;
+		start = ktime_get_ns();
+		memcpy(cal->coh + cal->max, cal->coh, len);
+		break;
+	case SDMA_PATH_USER:
+		/* map and unmap do the cache maintenance, not the transfer */
+		ret = sdma_cal_dma(dma_priv, cal->coh_dma,
+				   cal->coh_dma + cal->max, len, false, dma_ns);
+		if (ret)
+			return ret;
+		ret = sdma_cal_pin(cal, len, &ns);
+		if (ret)
+			return ret;
+		*dma_ns += ns;
+
+		cal->req->len = len;
+		cal->req->cpu_iov.len = len;
+		start = ktime_get_ns();
+		ret = sdma_req_cpu_copy(cal->req);
+		if (ret)
+			return ret;
+		break;
+	default:
+		return -EINVAL;
+	}
+	*cpu_ns = ktime_get_ns() - start;
+
+	return 0;
+}
+
+/*
+ * Measure both sides of a path for each size class and set its threshold
+ * to the smallest size the engine wins at. The best of a few rounds is
+ * kept for each side. If the engine never wins, copies up to the largest
+ * class measured stay on the CPU.
+ */
+static int sdma_cal_path(struct sdma_cal *cal, enum sdma_path path)
+{
+	struct dma_private *dma_priv = cal->dma_priv;
+	u64 dma_ns, cpu_ns, best_dma, best_cpu;
+	unsigned int i, r;
+	size_t len;
+	int ret;
+
+	for (i = 0; i < SDMA_CAL_CLASSES; i++) {
+		len = ALIGN(SDMA_CAL_MIN << i, dma_priv->copy_align);
+		if (len > dma_priv->max_chunk)
+			break;
+
+		best_dma = U64_MAX;
+		best_cpu = U64_MAX;
+		for (r = 0; r < SDMA_CAL_ROUNDS; r++) {
+			ret = sdma_cal_round(cal, path, len, &dma_ns, &cpu_ns);
+			if (ret)
+				return ret;
+			best_dma = min(best_dma, dma_ns);
+			best_cpu = min(best_cpu, cpu_ns);
+		}
+
+		dma_priv->cal_dma_ns[path][i] = best_dma;
+		dma_priv->cal_cpu_ns[path][i] = best_cpu;
+		dma_priv->nr_cal[path] = i + 1;
+
+		/* Past the last class measured the engine is assumed to win */
+		dma_priv->cpu_threshold[path] = len;
+		if (best_dma <= best_cpu)
+			break;
+	}
+
+	dev_info(dma_priv->dev, "%s copies below %zu bytes done by the CPU\n",
+		 sdma_path_names[path], dma_priv->cpu_threshold[path]);
+	return 0;
+}
+
+static int sdma_cal_setup(struct sdma_cal *cal)
+{
+	struct dma_private *dma_priv = cal->dma_priv;
+	struct device *dma_dev;
+	size_t max = cal->max;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+
+	cal->src = kmalloc(max, GFP_KERNEL);
+	cal->dst = kmalloc(max, GFP_KERNEL);
+	cal->req = kzalloc(sizeof(*cal->req), GFP_KERNEL);
+	if (!cal->src || !cal->dst || !cal->req)
+		goto err_free;
+
+	memset(cal->src, 0x5a, max);
+	cal->src_dma = dma_map_single(dma_dev, cal->src, max, DMA_TO_DEVICE);
+	if (dma_mapping_error(dma_dev, cal->src_dma))
+		goto err_free;
+	cal->dst_dma = dma_map_single(dma_dev, cal->dst, max,
+				      DMA_FROM_DEVICE);
+	if (dma_mapping_error(dma_dev, cal->dst_dma))
+		goto err_src;
+
+	cal->coh = dma_alloc_coherent(dma_dev, 2 * max, &cal->coh_dma,
+				      GFP_KERNEL);
+	if (!cal->coh)
+		goto err_dst;
+
+	/*
+	 * The user path is timed on a scratch mapping in the process that
+	 * probes us, usually modprobe. Without one it is not measured.
+	 */
+	if (current->mm && !(current->flags & PF_KTHREAD)) {
+		cal->uaddr = vm_mmap(NULL, 0, 2 * max, PROT_READ | PROT_WRITE,
+				     MAP_PRIVATE | MAP_ANONYMOUS, 0);
+		if (IS_ERR_VALUE(cal->uaddr) ||
+		    clear_user((void __user *)cal->uaddr, 2 * max)) {
+			if (!IS_ERR_VALUE(cal->uaddr))
+				vm_munmap(cal->uaddr, 2 * max);
+			cal->uaddr = 0;
+		}
+	}
+
+	/* A plain user to user copy, as sdma_req_create() sets it up */
+	cal->req->cpu_iov.base = cal->uaddr;
+	cal->req->iov = &cal->req->cpu_iov;
+	cal->req->nr_iov = 1;
+	cal->req->uaddr = cal->uaddr + max;
+
+	return 0;
+
+err_dst:
+	dma_unmap_single(dma_dev, cal->dst_dma, max, DMA_FROM_DEVICE);
+err_src:
+	dma_unmap_single(dma_dev, cal->src_dma, max, DMA_TO_DEVICE);
+err_free:
+	kfree(cal->req);
+	kfree(cal->dst);
+	kfree(cal->src);
+	return -ENOMEM;
+}
+
+static void sdma_cal_teardown(struct sdma_cal *cal)
+{
+	struct dma_private *dma_priv = cal->dma_priv;
+	struct device *dma_dev;
+	size_t max = cal->max;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+
+	if (cal->uaddr)
+		vm_munmap(cal->uaddr, 2 * max);
+	dma_free_coherent(dma_dev, 2 * max, cal->coh, cal->coh_dma);
+	dma_unmap_single(dma_dev, cal->dst_dma, max, DMA_FROM_DEVICE);
+	dma_unmap_single(dma_dev, cal->src_dma, max, DMA_TO_DEVICE);
+	kfree(cal->req);
+	kfree(cal->dst);
+	kfree(cal->src);
+}
+
+/*
+ * Calibrate every path against its own CPU fallback. Without a user
+ * context the user path borrows the pool's threshold. On failure
+ * everything keeps going to the engine. The thresholds can be overridden
+ * through sysfs.
+ */
+static void sdma_calibrate(struct dma_private *dma_priv)
+{
+	struct sdma_cal cal = { .dma_priv = dma_priv };
+	enum sdma_path path;
+	int ret;
+
+	cal.max = ALIGN(SDMA_CAL_MIN << (SDMA_CAL_CLASSES - 1),
+			dma_priv->copy_align);
+
+	ret = sdma_cal_setup(&cal);
+	if (ret)
+		goto out;
+
+	for (path = 0; !ret && path < SDMA_NR_PATHS; path++) {
+		if (path == SDMA_PATH_USER && !cal.uaddr) {
+			dma_priv->cpu_threshold[path] =
+				dma_priv->cpu_threshold[SDMA_PATH_POOL];
+			dev_info(dma_priv->dev,
+				 "no user context, user path not calibrated\n");
+			continue;
+		}
+		ret = sdma_cal_path(&cal, path);
+	}
+	sdma_cal_teardown(&cal);
+
+out:
+	if (ret) {
+		memset(dma_priv->cpu_threshold, 0,
+		       sizeof(dma_priv->cpu_threshold));
+		dev_warn(dma_priv->dev, "calibration failed (%d)\n", ret);
+	}
+}
+
+/*
+ * Split a request into parts. Large copies are striped over every channel
+ * in contiguous, copy aligned slices, anything else goes whole to the least
+ * loaded channel.
+ */
+static void sdma_req_plan(struct sdma_req *req)
+{
+	struct dma_private *dma_priv = req->dma_priv;
+	unsigned int n = dma_priv->nr_chans;
+	struct sdma_req_part *part;
+	size_t align;
+	unsigned int i;
+
+	align = req->fill ? dma_priv->fill_align : dma_priv->copy_align;
+	if (n < 2 || req->len < stripe_min || req->len / n < align)
+		n = 1;
+
+	req->nr_parts = n;
+	for (i = 0; i < n; i++) {
+		part = &req->parts[i];
+		part->req = req;
+		part->schan = n > 1 ? &dma_priv->chans[i] :
+				      sdma_pick_chan(dma_priv);
+		part->end = i == n - 1 ? req->len :
+					 ALIGN_DOWN(req->len / n * (i + 1),
+						    align);
+		part->cookie = -EINVAL;
+	}
+}
+
+static struct dma_async_tx_descriptor *
+sdma_prep(struct sdma_req *req, struct dma_chan *chan, dma_addr_t dst,
+	  dma_addr_t src, size_t len, unsigned long flags)
+{
+	if (req->fill)
+		return chan->device->device_prep_dma_memset(chan, dst,
+							     req->value, len,
+							     flags);
+	return dmaengine_prep_dma_memcpy(chan, dst, src, len, flags);
+}
+
+/*
+ * Submit a contiguous run of a request, split into pieces the engine takes
+ * in one descriptor and that do not cross a part boundary. Only the last
+ * descriptor of each part raises an interrupt, the engine completes the
+ * descriptors of a channel in order.
+ */
+static int sdma_req_submit_desc(struct sdma_req *req, dma_addr_t dst,
+				dma_addr_t src, size_t len)
+{
+	struct dma_private *dma_priv = req->dma_priv;
+	struct dma_async_tx_descriptor *desc;
+	struct sdma_req_part *part;
+	struct dma_chan *chan;
+	unsigned long flags;
+	dma_cookie_t c;
+	bool tail;
+	size_t n;
+
+	if (req->fill ? !is_dma_fill_aligned(dma_priv->dma_m2m_chan->device,
+					     dst, 0, len) :
+			!is_dma_copy_aligned(dma_priv->dma_m2m_chan->device,
+					     src, dst, len))
+		return -EINVAL;
+
+	while (len) {
+		part = &req->parts[req->cur_part];
+		chan = part->schan->chan;
+		n = min3(len, dma_priv->max_chunk, part->end - req->queued);
+		tail = req->queued + n == part->end;
+
+		flags = DMA_CTRL_ACK;
+		if (tail)
+			flags |= DMA_PREP_INTERRUPT;
+
+		desc = sdma_prep(req, chan, dst, src, n, flags);
+		if (!desc && !dma_submit_error(part->cookie)) {
+			/* Out of descriptors, let the queued ones drain */
+			dma_sync_wait(chan, part->cookie);
+			desc = sdma_prep(req, chan, dst, src, n, flags);
+		}
+		if (!desc)
+			return -ENOMEM;
+
+		/* Account before submit, the callback may run right away */
+		part->queued += n;
+		atomic_long_add(n, &part->schan->inflight);
+		if (tail) {
+			desc->callback_result = sdma_req_callback;
+			desc->callback_param = part;
+			atomic_inc(&req->leader->pending);
+		}
+
+		c = dmaengine_submit(desc);
+		if (dma_submit_error(c)) {
+			part->queued -= n;
+			atomic_long_sub(n, &part->schan->inflight);
+			if (tail)
+				atomic_dec(&req->leader->pending);
+			return -EIO;
+		}
+
+		part->cookie = c;
+		req->queued += n;
+		if (tail) {
+			req->nr_tails++;
+			req->cur_part++;
+		}
+		dst += n;
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/* Mapped segment holding byte *off of sg, *off becomes relative to it */
+static struct scatterlist *sdma_sg_seek(struct scatterlist *sg, size_t *off)
+{
+	while (*off >= sg_dma_len(sg)) {
+		*off -= sg_dma_len(sg);
+		sg = sg_next(sg);
+	}
+
+	return sg;
+}
+
+/*
+ * Queue a request on its channels. User buffers and dma-bufs are walked
+ * segment by segment in lock step, one run per overlap. The caller kicks
+ * the channels with sdma_issue_pending() and then drops its reference.
+ *
+ * On failure the parts already handed to the engine still complete through
+ * their callbacks, req->status records the error and nr_tails tells the
+ * caller whether anything is in flight at all.
+ */
+static int sdma_req_queue(struct sdma_req *req)
+{
+	struct dma_private *dma_priv = req->dma_priv;
+	size_t doff = req->dst.skip, soff = req->src.skip;
+	struct scatterlist *dsg, *ssg = NULL;
+	struct sdma_req_part *part;
+	dma_addr_t src = 0;
+	size_t len = req->len;
+	size_t n;
+	int ret;
+
+	/* Nothing goes to the engine, the submitter's put finishes it */
+	if (req->cpu) {
+		req->status = sdma_req_cpu_copy(req);
+		return req->status;
+	}
+
+	sdma_req_plan(req);
+
+	if (!req->dst.table) {
+		ret = sdma_req_submit_desc(req, req->dst_dma, req->src_dma,
+					   req->len);
+		if (ret)
+			goto err_flush;
+		return 0;
+	}
+
+	/* A fill has a destination only */
+	dsg = sdma_sg_seek(req->dst.table->sgl, &doff);
+	if (req->src.table)
+		ssg = sdma_sg_seek(req->src.table->sgl, &soff);
+
+	while (len) {
+		n = min_t(size_t, len, sg_dma_len(dsg) - doff);
+		if (ssg) {
+			n = min_t(size_t, n, sg_dma_len(ssg) - soff);
+			src = sg_dma_address(ssg) + soff;
+		}
+
+		ret = sdma_req_submit_desc(req, sg_dma_address(dsg) + doff,
+					   src, n);
+		if (ret)
+			goto err_flush;
+
+		len -= n;
+		doff += n;
+		soff += n;
+		if (len && doff == sg_dma_len(dsg)) {
+			dsg = sg_next(dsg);
+			doff = 0;
+		}
+		if (len && ssg && soff == sg_dma_len(ssg)) {
+			ssg = sg_next(ssg);
+			soff = 0;
+		}
+	}
+
+	return 0;
+
+err_flush:
+	/*
+	 * The part being queued has no callback to wait for, let its
+	 * descriptors drain before the buffers can be unmapped.
+	 */
+	dev_err(dma_priv->dev, "Failed to queue DMA descriptor\n");
+	part = &req->parts[req->cur_part];
+	if (!dma_submit_error(part->cookie)) {
+		dma_sync_wait(part->schan->chan, part->cookie);
+		atomic_long_sub(part->queued, &part->schan->inflight);
+	}
+	req->status = ret;
+	return ret;
+}
+
+static bool sdma_reserve_slot(struct sdma_ctx *ctx)
+{
+	bool ok;
+
+	spin_lock_irq(&ctx->req_lock);
+	ok = ctx->nr_queued < queue_depth;
+	if (ok)
+		ctx->nr_queued++;
+	spin_unlock_irq(&ctx->req_lock);
+
+	return ok;
+}
+
+static void sdma_release_slot(struct sdma_ctx *ctx)
+{
+	spin_lock_irq(&ctx->req_lock);
+	ctx->nr_queued--;
+	spin_unlock_irq(&ctx->req_lock);
+}
+
+/*
+ * Queue a prepared request, then wait for it or, if async, leave it to the
+ * reap ring and report its cookie through cookiep. An async caller must
+ * hold a ring slot. The request and, on failure, the slot are consumed.
+ */
+static long sdma_req_run(struct sdma_ctx *ctx, struct sdma_req *req,
+			 bool async, u64 user_data, __u64 __user *cookiep)
+{
+	int ret;
+
+	req->async = async;
+	req->user_data = user_data;
+	req->cookie = atomic64_inc_return(&ctx->next_cookie);
+
+	if (async && put_user(req->cookie, cookiep)) {
+		ret = -EFAULT;
+		goto err_req;
+	}
+
+	/* With parts in flight the error is reported through the ring */
+	ret = sdma_req_queue(req);
+	if (ret && async && !req->nr_tails)
+		goto err_req;
+
+	sdma_issue_pending(ctx->dma_priv);
+	sdma_req_put(req);
+
+	if (async)
+		return 0;
+
+	wait_for_completion(&req->done);
+	ret = req->status;
+	sdma_req_destroy(req);
+	return ret;
+
+err_req:
+	sdma_req_destroy(req);
+	if (async)
+		sdma_release_slot(ctx);
+	return ret;
+}
+
+static long sdma_ioctl_copy(struct sdma_ctx *ctx,
+			    struct sdma_copy __user *argp)
+{
+	struct sdma_copy args;
+	struct sdma_req *req;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	req = sdma_req_create(ctx, args.src, args.dst, args.len);
+	if (IS_ERR(req))
+		return PTR_ERR(req);
+
+	return sdma_req_run(ctx, req, false, 0, NULL);
+}
+
+static long sdma_ioctl_submit(struct sdma_ctx *ctx,
+			      struct sdma_submit __user *argp)
+{
+	struct sdma_submit args;
+	struct sdma_req *req;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	/* Reserve a slot, completions are only freed once reaped */
+	if (!sdma_reserve_slot(ctx))
+		return -EBUSY;
+
+	req = sdma_req_create(ctx, args.src, args.dst, args.len);
+	if (IS_ERR(req)) {
+		sdma_release_slot(ctx);
+		return PTR_ERR(req);
+	}
+
+	return sdma_req_run(ctx, req, true, args.user_data, &argp->cookie);
+}
+
+static long sdma_ioctl_reap(struct sdma_ctx *ctx,
+			    struct sdma_reap __user *argp)
+{
+	struct sdma_completion __user *entries;
+	struct sdma_completion comp = {};
+	struct sdma_req *req;
+	struct sdma_reap args;
+	unsigned int reaped = 0;
+	int ret = 0;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	if (args.min_complete > args.count)
+		return -EINVAL;
+
+	entries = u64_to_user_ptr(args.entries);
+
+	while (reaped < args.count) {
+		spin_lock_irq(&ctx->req_lock);
+		req = list_first_entry_or_null(&ctx->done_list,
+					       struct sdma_req, node);
+		if (req)
+			list_del(&req->node);
+		spin_unlock_irq(&ctx->req_lock);
+
+		if (!req) {
+			if (reaped >= args.min_complete)
+				break;
+			ret = wait_event_interruptible(
+				ctx->wq_done,
+				!list_empty_careful(&ctx->done_list));
+			if (ret)
+				break;
+			continue;
+		}
+
+		comp.cookie = req->cookie;
+		comp.user_data = req->user_data;
+		comp.status = sdma_req_status(req);
+		if (copy_to_user(&entries[reaped], &comp, sizeof(comp))) {
+			/* Put it back so the completion is not lost */
+			spin_lock_irq(&ctx->req_lock);
+			list_add(&req->node, &ctx->done_list);
+			spin_unlock_irq(&ctx->req_lock);
+			ret = -EFAULT;
+			break;
+		}
+
+		spin_lock_irq(&ctx->req_lock);
+		ctx->nr_queued--;
+		ctx->nr_done--;
+		spin_unlock_irq(&ctx->req_lock);
+
+		sdma_req_destroy(req);
+		reaped++;
+	}
+
+	if (put_user(reaped, &argp->count))
+		return -EFAULT;
+
+	return reaped ? 0 : ret;
+}
+
+/*
+ * Queue one job of a batch. In per-job mode every job is its own request
+ * with its own ring slot, otherwise it joins the batch leader, whose
+ * submitter reference is held until all jobs have been queued.
+ */
+static int sdma_batch_queue_job(struct sdma_ctx *ctx, struct sdma_job *job,
+				struct sdma_req **leader,
+				struct sdma_req **slot, bool per_job,
+				bool async, u64 user_data, u64 cookie)
+{
+	struct sdma_req *req;
+	int ret;
+
+	if (per_job && !sdma_reserve_slot(ctx))
+		return -EBUSY;
+
+	req = sdma_req_create(ctx, job->src, job->dst, job->len);
+	if (IS_ERR(req)) {
+		ret = PTR_ERR(req);
+		goto err_slot;
+	}
+
+	req->async = async;
+	req->user_data = user_data;
+	req->cookie = cookie;
+
+	if (!per_job) {
+		if (!*leader) {
+			*leader = req;
+		} else {
+			req->leader = *leader;
+			list_add_tail(&req->node, &(*leader)->batch);
+		}
+	}
+
+	ret = sdma_req_queue(req);
+	if (per_job) {
+		if (ret && !req->nr_tails) {
+			sdma_req_free(req);
+			goto err_slot;
+		}
+		/* With parts in flight the ring reports the error */
+		sdma_req_put(req);
+		return 0;
+	}
+
+	/* A failed batch member stays with the leader and is freed with it */
+	if (ret)
+		return ret;
+
+	*slot = req;
+	return 0;
+
+err_slot:
+	if (per_job)
+		sdma_release_slot(ctx);
+	return ret;
+}
+
+static long sdma_ioctl_batch(struct sdma_ctx *ctx,
+			     struct sdma_batch __user *argp)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct sdma_req *leader = NULL;
+	struct sdma_req **reqs;
+	struct sdma_batch args;
+	struct sdma_job *jobs;
+	bool per_job;
+	bool async;
+	u64 cookie;
+	long ret = 0;
+	u32 i;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	if (!args.count || args.count > SDMA_BATCH_MAX_JOBS ||
+	    args.flags & ~(SDMA_BATCH_WAIT | SDMA_BATCH_PER_JOB))
+		return -EINVAL;
+
+	/* Without the reap ring there is nothing to report per job */
+	async = !(args.flags & SDMA_BATCH_WAIT);
+	per_job = async && (args.flags & SDMA_BATCH_PER_JOB);
+
+	jobs = vmemdup_user(u64_to_user_ptr(args.jobs),
+			    array_size(args.count, sizeof(*jobs)));
+	if (IS_ERR(jobs))
+		return PTR_ERR(jobs);
+
+	reqs = kvcalloc(args.count, sizeof(*reqs), GFP_KERNEL);
+	if (!reqs) {
+		ret = -ENOMEM;
+		goto out_jobs;
+	}
+
+	/* A whole batch takes a single slot of the reap ring */
+	if (async && !per_job && !sdma_reserve_slot(ctx)) {
+		ret = -EBUSY;
+		goto out_reqs;
+	}
+
+	cookie = atomic64_add_return(args.count, &ctx->next_cookie) -
+		 args.count + 1;
+
+	for (i = 0; i < args.count; i++)
+		jobs[i].status = sdma_batch_queue_job(
+			ctx, &jobs[i], &leader, &reqs[i], per_job, async,
+			args.user_data, per_job ? cookie + i : cookie);
+
+	/* even a failed job may have stripes submitted on other channels */
+	sdma_issue_pending(dma_priv);
+
+	if (leader) {
+		/* The batch may be finished already */
+		sdma_req_put(leader);
+	} else if (async && !per_job) {
+		sdma_release_slot(ctx);
+	}
+
+	if (!async) {
+		if (leader)
+			wait_for_completion(&leader->done);
+		for (i = 0; i < args.count; i++)
+			if (reqs[i])
+				jobs[i].status = reqs[i]->status;
+	}
+
+	if (copy_to_user(u64_to_user_ptr(args.jobs), jobs,
+			 array_size(args.count, sizeof(*jobs))) ||
+	    put_user(cookie, &argp->cookie))
+		ret = -EFAULT;
+
+	if (!async && leader)
+		sdma_req_destroy(leader);
+
+out_reqs:
+	kvfree(reqs);
+out_jobs:
+	kvfree(jobs);
+	return ret;
+}
+
+static long sdma_ioctl_kick(struct sdma_ctx *ctx,
+			    struct sdma_kick __user *argp)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	size_t size = dma_priv->mmap_size;
+	struct sdma_kick args;
+	struct sdma_req *req;
+	void *mmap_buf;
+	bool async;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	/* Nothing to copy within before the buffer has been mapped */
+	mmap_buf = smp_load_acquire(&ctx->mmap_buf);
+	if (!mmap_buf)
+		return -ENXIO;
+
+	if (args.flags & ~SDMA_KICK_ASYNC || !args.len ||
+	    args.src_off > size || args.len > size - args.src_off ||
+	    args.dst_off > size || args.len > size - args.dst_off)
+		return -EINVAL;
+
+	/* memcpy semantics, the engine gives no ordering within a copy */
+	if (args.src_off < args.dst_off + args.len &&
+	    args.dst_off < args.src_off + args.len)
+		return -EINVAL;
+
+	async = args.flags & SDMA_KICK_ASYNC;
+	if (async && !sdma_reserve_slot(ctx))
+		return -EBUSY;
+
+	req = sdma_req_alloc(ctx, args.len);
+	if (!req) {
+		if (async)
+			sdma_release_slot(ctx);
+		return -ENOMEM;
+	}
+
+	if (sdma_use_cpu(dma_priv, SDMA_PATH_COHERENT, args.len)) {
+		req->cpu = true;
+		req->src_buf = mmap_buf + args.src_off;
+		req->dst_buf = mmap_buf + args.dst_off;
+	} else {
+		req->src_dma = ctx->mmap_dma + args.src_off;
+		req->dst_dma = ctx->mmap_dma + args.dst_off;
+	}
+
+	return sdma_req_run(ctx, req, async, args.user_data, &argp->cookie);
+}
+
+static long sdma_ioctl_fill(struct sdma_ctx *ctx,
+			    struct sdma_fill __user *argp)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct sdma_fill args;
+	struct sdma_req *req;
+	bool async;
+	int ret;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	if (args.flags & ~SDMA_FILL_ASYNC || !args.len || args.len > INT_MAX ||
+	    args.dst + args.len < args.dst)
+		return -EINVAL;
+
+	async = args.flags & SDMA_FILL_ASYNC;
+	if (async && !sdma_reserve_slot(ctx))
+		return -EBUSY;
+
+	req = sdma_req_alloc(ctx, args.len);
+	if (!req) {
+		ret = -ENOMEM;
+		goto err_slot;
+	}
+
+	req->fill = true;
+	req->value = args.value;
+
+	/* Without memset support the CPU fills, as it does short runs */
+	if (!dma_priv->has_memset ||
+	    sdma_use_cpu(dma_priv, SDMA_PATH_USER, args.len)) {
+		req->cpu = true;
+		req->uaddr = args.dst;
+	} else {
+		ret = sdma_pin_user_buf(dma_priv, &req->dst, args.dst,
+					args.len, DMA_FROM_DEVICE);
+		if (ret)
+			goto err_req;
+	}
+
+	return sdma_req_run(ctx, req, async, args.user_data, &argp->cookie);
+
+err_req:
+	sdma_req_destroy(req);
+err_slot:
+	if (async)
+		sdma_release_slot(ctx);
+	return ret;
+}
+
+/*
+ * Gather an I/O vector into a contiguous buffer or scatter the buffer over
+ * it. The vector side is pinned as one scatterlist so the engine sees the
+ * usual pair of lists walked in lock step.
+ */
+static long sdma_ioctl_sg_copy(struct sdma_ctx *ctx,
+			       struct sdma_sg_copy __user *argp)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct sdma_user_buf *vbuf, *cbuf;
+	struct sdma_sg_copy args;
+	struct sdma_iovec *iov;
+	struct sdma_req *req;
+	size_t len = 0;
+	bool scatter;
+	bool async;
+	unsigned int i;
+	int ret;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	if (args.flags & ~(SDMA_SG_ASYNC | SDMA_SG_SCATTER) ||
+	    !args.nr_iov || args.nr_iov > SDMA_SG_MAX_IOV)
+		return -EINVAL;
+
+	iov = vmemdup_user(u64_to_user_ptr(args.iov),
+			   array_size(args.nr_iov, sizeof(*iov)));
+	if (IS_ERR(iov))
+		return PTR_ERR(iov);
+
+	/* Keep page counts in range of an int */
+	for (i = 0; i < args.nr_iov; i++) {
+		if (iov[i].base + iov[i].len < iov[i].base ||
+		    iov[i].len > INT_MAX - len) {
+			ret = -EINVAL;
+			goto err_iov;
+		}
+		len += iov[i].len;
+	}
+	if (!len || args.buf + len < args.buf) {
+		ret = -EINVAL;
+		goto err_iov;
+	}
+
+	scatter = args.flags & SDMA_SG_SCATTER;
+	async = args.flags & SDMA_SG_ASYNC;
+	if (async && !sdma_reserve_slot(ctx)) {
+		ret = -EBUSY;
+		goto err_iov;
+	}
+
+	req = sdma_req_alloc(ctx, len);
+	if (!req) {
+		ret = -ENOMEM;
+		goto err_slot;
+	}
+
+	/* The request owns the vector from here on */
+	req->iov = iov;
+	req->nr_iov = args.nr_iov;
+	req->scatter = scatter;
+	req->uaddr = args.buf;
+
+	if (sdma_use_cpu(dma_priv, SDMA_PATH_USER, len)) {
+		req->cpu = true;
+		goto run;
+	}
+
+	vbuf = scatter ? &req->dst : &req->src;
+	cbuf = scatter ? &req->src : &req->dst;
+
+	ret = sdma_pin_user_iov(dma_priv, vbuf, iov, args.nr_iov,
+				scatter ? DMA_FROM_DEVICE : DMA_TO_DEVICE);
+	if (ret)
+		goto err_req;
+
+	ret = sdma_pin_user_buf(dma_priv, cbuf, args.buf, len,
+				scatter ? DMA_TO_DEVICE : DMA_FROM_DEVICE);
+	if (ret)
+		goto err_req;
+
+run:
+	return sdma_req_run(ctx, req, async, args.user_data, &argp->cookie);
+
+err_req:
+	/* Frees the vector along with the request */
+	sdma_req_destroy(req);
+	iov = NULL;
+err_slot:
+	if (async)
+		sdma_release_slot(ctx);
+err_iov:
+	kvfree(iov);
+	return ret;
+}
+
+/* Pin a user space buffer, or import a dma-buf when fd is valid */
+static int sdma_get_buf(struct dma_private *dma_priv,
+			struct sdma_user_buf *ubuf, int fd, u64 addr,
+			u64 len, enum dma_data_direction dir)
+{
+	if (fd >= 0)
+		return sdma_import_buf(dma_priv, ubuf, fd, addr, len, dir);
+
+	if (addr + len < addr)
+		return -EINVAL;
+	return sdma_pin_user_buf(dma_priv, ubuf, addr, len, dir);
+}
+
+static long sdma_ioctl_dmabuf_copy(struct sdma_ctx *ctx,
+				   struct sdma_dmabuf_copy __user *argp)
+{
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct sdma_dmabuf_copy args;
+	struct sdma_req *req;
+	bool async;
+	int ret;
+
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	if (args.flags & ~SDMA_DMABUF_ASYNC || !args.len || args.len > INT_MAX)
+		return -EINVAL;
+
+	async = args.flags & SDMA_DMABUF_ASYNC;
+	if (async && !sdma_reserve_slot(ctx))
+		return -EBUSY;
+
+	/* Always on the engine, dma-bufs are not mapped for the CPU */
+	req = sdma_req_alloc(ctx, args.len);
+	if (!req) {
+		ret = -ENOMEM;
+		goto err_slot;
+	}
+
+	ret = sdma_get_buf(dma_priv, &req->src, args.src_fd, args.src,
+			   args.len, DMA_TO_DEVICE);
+	if (ret)
+		goto err_req;
+
+	ret = sdma_get_buf(dma_priv, &req->dst, args.dst_fd, args.dst,
+			   args.len, DMA_FROM_DEVICE);
+	if (ret)
+		goto err_req;
+
+	return sdma_req_run(ctx, req, async, args.user_data, &argp->cookie);
+
+err_req:
+	sdma_req_destroy(req);
+err_slot:
+	if (async)
+		sdma_release_slot(ctx);
+	return ret;
+}
+
+static int sdma_dmabuf_attach(struct dma_buf *dmabuf,
+			      struct dma_buf_attachment *attach)
+{
+	struct sdma_dmabuf *buf = dmabuf->priv;
+	struct sdma_dmabuf_attachment *a;
+	int ret;
+
+	a = kzalloc(sizeof(*a), GFP_KERNEL);
+	if (!a)
+		return -ENOMEM;
+
+	ret = sg_alloc_table_from_pages(&a->sgt, buf->pages, buf->nr_pages, 0,
+					dmabuf->size, GFP_KERNEL);
+	if (ret) {
+		kfree(a);
+		return ret;
+	}
+
+	a->dev = attach->dev;
+	attach->priv = a;
+
+	mutex_lock(&buf->lock);
+	list_add(&a->node, &buf->attachments);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static void sdma_dmabuf_detach(struct dma_buf *dmabuf,
+			       struct dma_buf_attachment *attach)
+{
+	struct sdma_dmabuf *buf = dmabuf->priv;
+	struct sdma_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	list_del(&a->node);
+	mutex_unlock(&buf->lock);
+
+	sg_free_table(&a->sgt);
+	kfree(a);
+}
+
+static struct sg_table *sdma_dmabuf_map(struct dma_buf_attachment *attach,
+					enum dma_data_direction dir)
+{
+	struct sdma_dmabuf *buf = attach->dmabuf->priv;
+	struct sdma_dmabuf_attachment *a = attach->priv;
+	int ret;
+
+	ret = dma_map_sgtable(attach->dev, &a->sgt, dir, 0);
+	if (ret)
+		return ERR_PTR(ret);
+
+	mutex_lock(&buf->lock);
+	a->mapped = true;
+	mutex_unlock(&buf->lock);
+
+	return &a->sgt;
+}
+
+static void sdma_dmabuf_unmap(struct dma_buf_attachment *attach,
+			      struct sg_table *sgt,
+			      enum dma_data_direction dir)
+{
+	struct sdma_dmabuf *buf = attach->dmabuf->priv;
+	struct sdma_dmabuf_attachment *a = attach->priv;
+
+	mutex_lock(&buf->lock);
+	a->mapped = false;
+	mutex_unlock(&buf->lock);
+
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+}
+
+/* Hand the pages to the CPU, discarding lines a device has written */
+static int sdma_dmabuf_begin_cpu_access(struct dma_buf *dmabuf,
+					enum dma_data_direction dir)
+{
+	struct sdma_dmabuf *buf = dmabuf->priv;
+	struct sdma_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node)
+		if (a->mapped)
+			dma_sync_sgtable_for_cpu(a->dev, &a->sgt, dir);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+/* Write back what the CPU wrote before any device reads it */
+static int sdma_dmabuf_end_cpu_access(struct dma_buf *dmabuf,
+				      enum dma_data_direction dir)
+{
+	struct sdma_dmabuf *buf = dmabuf->priv;
+	struct sdma_dmabuf_attachment *a;
+
+	mutex_lock(&buf->lock);
+	list_for_each_entry(a, &buf->attachments, node)
+		if (a->mapped)
+			dma_sync_sgtable_for_device(a->dev, &a->sgt, dir);
+	mutex_unlock(&buf->lock);
+
+	return 0;
+}
+
+static int sdma_dmabuf_mmap(struct dma_buf *dmabuf, struct vm_area_struct *vma)
+{
+	struct sdma_dmabuf *buf = dmabuf->priv;
+
+	return vm_map_pages(vma, buf->pages, buf->nr_pages);
+}
+
+static void sdma_dmabuf_free(struct sdma_dmabuf *buf)
+{
+	unsigned int i;
+
+	for (i = 0; buf->pages && i < buf->nr_pages; i++)
+		if (buf->pages[i])
+			__free_page(buf->pages[i]);
+	kvfree(buf->pages);
+	kfree(buf);
+}
+
+/* Called once the last importer and the last file reference are gone */
+static void sdma_dmabuf_release(struct dma_buf *dmabuf)
+{
+	sdma_dmabuf_free(dmabuf->priv);
+}
+
+static const struct dma_buf_ops sdma_dmabuf_ops = {
+	.attach = sdma_dmabuf_attach,
+	.detach = sdma_dmabuf_detach,
+	.map_dma_buf = sdma_dmabuf_map,
+	.unmap_dma_buf = sdma_dmabuf_unmap,
+	.begin_cpu_access = sdma_dmabuf_begin_cpu_access,
+	.end_cpu_access = sdma_dmabuf_end_cpu_access,
+	.mmap = sdma_dmabuf_mmap,
+	.release = sdma_dmabuf_release,
 };
 
-#define SDMA_BUF_SIZE 4096
+/*
+ * Export a zeroed, page backed buffer. It does not depend on the device and
+ * may outlive it, the dma-buf core holds a module reference meanwhile.
+ */
+static long sdma_ioctl_export(struct dma_private *dma_priv,
+			      struct sdma_export __user *argp)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct sdma_export args;
+	struct sdma_dmabuf *buf;
+	struct dma_buf *dmabuf;
+	unsigned int i;
+	int fd;
 
-static void dma_m2m_callback(void *data)
+	if (copy_from_user(&args, argp, sizeof(args)))
+		return -EFAULT;
+
+	if (!args.size || args.size > INT_MAX || args.flags)
+		return -EINVAL;
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	mutex_init(&buf->lock);
+	INIT_LIST_HEAD(&buf->attachments);
+
+	buf->nr_pages = DIV_ROUND_UP(args.size, PAGE_SIZE);
+	buf->pages = kvcalloc(buf->nr_pages, sizeof(*buf->pages),
+			      GFP_KERNEL);
+	if (!buf->pages)
+		goto err_free;
+
+	for (i = 0; i < buf->nr_pages; i++) {
+		buf->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!buf->pages[i])
+			goto err_free;
+	}
+
+	exp_info.ops = &sdma_dmabuf_ops;
+	exp_info.size = (size_t)buf->nr_pages << PAGE_SHIFT;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = buf;
+
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		sdma_dmabuf_free(buf);
+		return PTR_ERR(dmabuf);
+	}
+
+	/* From here on the buffer is freed through release */
+	fd = dma_buf_fd(dmabuf, O_CLOEXEC);
+	if (fd < 0)
+		dma_buf_put(dmabuf);
+
+	return fd;
+
+err_free:
+	sdma_dmabuf_free(buf);
+	return -ENOMEM;
+}
+
+static long sdma_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	struct sdma_ctx *ctx = file->private_data;
+
+	switch (cmd) {
+	case SDMA_IOC_COPY:
+		return sdma_ioctl_copy(ctx, (void __user *)arg);
+	case SDMA_IOC_SUBMIT:
+		return sdma_ioctl_submit(ctx, (void __user *)arg);
+	case SDMA_IOC_REAP:
+		return sdma_ioctl_reap(ctx, (void __user *)arg);
+	case SDMA_IOC_BATCH:
+		return sdma_ioctl_batch(ctx, (void __user *)arg);
+	case SDMA_IOC_KICK:
+		return sdma_ioctl_kick(ctx, (void __user *)arg);
+	case SDMA_IOC_MMAP_SIZE:
+		return put_user((u64)ctx->dma_priv->mmap_size,
+				(u64 __user *)arg);
+	case SDMA_IOC_EXPORT:
+		return sdma_ioctl_export(ctx->dma_priv, (void __user *)arg);
+	case SDMA_IOC_DMABUF_COPY:
+		return sdma_ioctl_dmabuf_copy(ctx, (void __user *)arg);
+	case SDMA_IOC_FILL:
+		return sdma_ioctl_fill(ctx, (void __user *)arg);
+	case SDMA_IOC_SG_COPY:
+		return sdma_ioctl_sg_copy(ctx, (void __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static __poll_t sdma_poll(struct file *file, poll_table *wait)
 {
-	struct dma_private *dma_priv = data;
-	dev_info(dma_priv->dev, "%s\n finished DMA transaction", __func__);
-	complete(&dma_priv->dma_m2m_ok);
+	struct sdma_ctx *ctx = file->private_data;
+	__poll_t mask = 0;
 
-	if (*(dma_priv->rbuf) != *(dma_priv->wbuf))
-		dev_err(dma_priv->dev, "buffer copy failed!\n");
+	poll_wait(file, &ctx->wq_done, wait);
 
-	dev_info(dma_priv->dev, "buffer copy passed!\n");
-	dev_info(dma_priv->dev, "wbuf is %s\n", dma_priv->wbuf);
-	dev_info(dma_priv->dev, "rbuf is %s\n", dma_priv->rbuf);
+	spin_lock_irq(&ctx->req_lock);
+	if (!list_empty(&ctx->done_list))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (ctx->nr_queued < queue_depth)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+	spin_unlock_irq(&ctx->req_lock);
+
+	return mask;
 }
 
-static ssize_t sdma_write(struct file *file, const char __user *buf,
-			  size_t count, loff_t *offset)
+static int sdma_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct sdma_ctx *ctx = file->private_data;
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct device *dma_dev;
+	int ret = 0;
+
+	mutex_lock(&ctx->mmap_lock);
+	if (!ctx->mmap_buf)
+		ret = sdma_mmap_buf_create(ctx);
+	mutex_unlock(&ctx->mmap_lock);
+	if (ret)
+		return ret;
+
+	dma_dev = dmaengine_get_dma_device(dma_priv->dma_m2m_chan);
+	return dma_mmap_coherent(dma_dev, vma, ctx->mmap_buf,
+				 ctx->mmap_dma, dma_priv->mmap_size);
+}
+
+static int sdma_open(struct inode *inode, struct file *file)
 {
-	struct dma_async_tx_descriptor *dma_m2m_desc;
-	struct dma_device *dma_dev;
 	struct dma_private *dma_priv;
-	dma_cookie_t cookie;
-	dma_addr_t dma_src;
-	dma_addr_t dma_dst;
+	struct sdma_ctx *ctx;
 
 	dma_priv = container_of(file->private_data, struct dma_private,
 				dma_misc_device);
 
-	dma_dev = dma_priv->dma_m2m_chan->device;
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
 
-	if (copy_from_user(dma_priv->wbuf, buf, count)) {
-		return -EFAULT;
-	}
+	ctx->dma_priv = dma_priv;
+	spin_lock_init(&ctx->req_lock);
+	INIT_LIST_HEAD(&ctx->done_list);
+	init_waitqueue_head(&ctx->wq_done);
+	atomic64_set(&ctx->next_cookie, 0);
+	mutex_init(&ctx->mmap_lock);
 
-	dev_info(dma_priv->dev, "The wbuf string is %s\n", dma_priv->wbuf);
+	atomic_inc(&dma_priv->nr_ctx);
+	file->private_data = ctx;
 
-	dma_src = dma_map_single(dma_priv->dev, dma_priv->wbuf, SDMA_BUF_SIZE,
-				 DMA_TO_DEVICE);
+	return 0;
+}
 
-	dev_info(dma_priv->dev, "dma_src map obtained");
+/* Let the context's async requests finish, then drop the unreaped ones */
+static int sdma_release(struct inode *inode, struct file *file)
+{
+	struct sdma_ctx *ctx = file->private_data;
+	struct dma_private *dma_priv = ctx->dma_priv;
+	struct sdma_req *req, *tmp;
 
-	dma_dst = dma_map_single(dma_priv->dev, dma_priv->rbuf, SDMA_BUF_SIZE,
-				 DMA_TO_DEVICE);
+	wait_event(ctx->wq_done,
+		   READ_ONCE(ctx->nr_done) == READ_ONCE(ctx->nr_queued));
+	/* the last completion may still be inside sdma_req_finish() */
+	spin_lock_irq(&ctx->req_lock);
+	spin_unlock_irq(&ctx->req_lock);
 
-	dev_info(dma_priv->dev, "dma_dst map obtained");
+	list_for_each_entry_safe(req, tmp, &ctx->done_list, node)
+		sdma_req_destroy(req);
 
-	dma_m2m_desc = dma_dev->device_prep_dma_memcpy(
-		dma_priv->dma_m2m_chan, dma_dst, dma_src, SDMA_BUF_SIZE,
-		DMA_CTRL_ACK | DMA_PREP_INTERRUPT);
+	sdma_mmap_buf_destroy(ctx);
+	kfree(ctx);
 
-	dev_info(dma_priv->dev, "successful descriptor obtained");
+	if (atomic_dec_and_test(&dma_priv->nr_ctx))
+		wake_up(&dma_priv->wq_ctx);
 
-	dma_m2m_desc->callback = dma_m2m_callback;
-	dma_m2m_desc->callback_param = dma_priv;
-	init_completion(&dma_priv->dma_m2m_ok);
+	return 0;
+}
 
-	cookie = dmaengine_submit(dma_m2m_desc);
+/*
+ * sysfs methods
+ */
 
-	if (dma_submit_error(cookie)) {
-		dev_err(dma_priv->dev, "Failed to submit DMA\n");
-		return -EINVAL;
-	};
-	dma_async_issue_pending(dma_priv->dma_m2m_chan);
-	wait_for_completion(&dma_priv->dma_m2m_ok);
-	dma_async_is_tx_complete(dma_priv->dma_m2m_chan, cookie, NULL, NULL);
+/* one line per channel: name, bytes in flight, bytes copied */
+static ssize_t channels_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct dma_private *dma_priv;
+	struct sdma_chan *schan;
+	int len = 0;
+	unsigned int i;
+
+	dma_priv = container_of(misc, struct dma_private, dma_misc_device);
+
+	for (i = 0; i < dma_priv->nr_chans; i++) {
+		schan = &dma_priv->chans[i];
+		len += sysfs_emit_at(buf, len, "%s %ld %lld\n",
+				     dma_chan_name(schan->chan),
+				     atomic_long_read(&schan->inflight),
+				     atomic64_read(&schan->bytes));
+	}
+
+	return len;
+}
+static DEVICE_ATTR_RO(channels);
+
+/*
+ * Copies shorter than this many bytes are done by the CPU, 0 disables.
+ * One "<path> <bytes>" line per path; writing "<path> <bytes>" sets one
+ * path, a bare number sets them all.
+ */
+static ssize_t cpu_threshold_show(struct device *dev,
+				  struct device_attribute *attr, char *buf)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct dma_private *dma_priv;
+	enum sdma_path path;
+	int len = 0;
+
+	dma_priv = container_of(misc, struct dma_private, dma_misc_device);
 
-	dev_info(dma_priv->dev, "The rbuf string is %s\n", dma_priv->rbuf);
+	for (path = 0; path < SDMA_NR_PATHS; path++)
+		len += sysfs_emit_at(buf, len, "%s %zu\n",
+				     sdma_path_names[path],
+				     READ_ONCE(dma_priv->cpu_threshold[path]));
 
-	dma_unmap_single(dma_priv->dev, dma_src, SDMA_BUF_SIZE, DMA_TO_DEVICE);
-	dma_unmap_single(dma_priv->dev, dma_dst, SDMA_BUF_SIZE, DMA_TO_DEVICE);
+	return len;
+}
+
+static ssize_t cpu_threshold_store(struct device *dev,
+				   struct device_attribute *attr,
+				   const char *buf, size_t count)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct dma_private *dma_priv;
+	unsigned long threshold;
+	enum sdma_path path;
+	int only = -1;
+	size_t n;
+	int ret;
+
+	dma_priv = container_of(misc, struct dma_private, dma_misc_device);
+
+	for (path = 0; path < SDMA_NR_PATHS; path++) {
+		n = strlen(sdma_path_names[path]);
+		if (!strncmp(buf, sdma_path_names[path], n) && buf[n] == ' ') {
+			only = path;
+			buf += n + 1;
+			break;
+		}
+	}
+
+	ret = kstrtoul(buf, 0, &threshold);
+	if (ret)
+		return ret;
+
+	for (path = 0; path < SDMA_NR_PATHS; path++)
+		if (only < 0 || only == path)
+			WRITE_ONCE(dma_priv->cpu_threshold[path], threshold);
 
 	return count;
 }
+static DEVICE_ATTR_RW(cpu_threshold);
+
+/*
+ * One line per path and size class measured at probe: path, bytes,
+ * engine ns, CPU ns
+ */
+static ssize_t calibration_show(struct device *dev,
+				struct device_attribute *attr, char *buf)
+{
+	struct miscdevice *misc = dev_get_drvdata(dev);
+	struct dma_private *dma_priv;
+	enum sdma_path path;
+	int len = 0;
+	unsigned int i;
+
+	dma_priv = container_of(misc, struct dma_private, dma_misc_device);
+
+	for (path = 0; path < SDMA_NR_PATHS; path++)
+		for (i = 0; i < dma_priv->nr_cal[path]; i++)
+			len += sysfs_emit_at(buf, len, "%s %zu %llu %llu\n",
+					     sdma_path_names[path],
+					     ALIGN((size_t)SDMA_CAL_MIN << i,
+						   dma_priv->copy_align),
+					     dma_priv->cal_dma_ns[path][i],
+					     dma_priv->cal_cpu_ns[path][i]);
+
+	return len;
+}
+static DEVICE_ATTR_RO(calibration);
+
+static struct attribute *sdma_attrs[] = {
+	&dev_attr_channels.attr,
+	&dev_attr_cpu_threshold.attr,
+	&dev_attr_calibration.attr,
+	NULL,
+};
+
+ATTRIBUTE_GROUPS(sdma);
 
 struct file_operations dma_fops = {
+	owner: THIS_MODULE,
+	open: sdma_open,
+	release: sdma_release,
 	write: sdma_write,
+	poll: sdma_poll,
+	mmap: sdma_mmap,
+	unlocked_ioctl: sdma_ioctl,
+	compat_ioctl: compat_ptr_ioctl,
 };
 
+static bool sdma_chan_filter(struct dma_chan *chan, void *param)
+{
+	/* Buffers are mapped for one DMA device, stay on it */
+	return chan->device == param;
+}
+
+static void sdma_release_channels(struct dma_private *dma_priv)
+{
+	while (dma_priv->nr_chans)
+		dma_release_channel(dma_priv->chans[--dma_priv->nr_chans].chan);
+}
+
+/*
+ * Grab up to nr_channels memcpy channels, or as many as the
+ * "arrow,dma-channels" device tree property asks for. Fewer is fine as long
+ * as there is at least one.
+ */
+static int sdma_request_channels(struct dma_private *dma_priv)
+{
+	struct dma_device *dma_dev = NULL;
+	dma_cap_mask_t dma_m2m_mask;
+	struct dma_chan *chan;
+	u32 nr = nr_channels;
+
+	device_property_read_u32(dma_priv->dev, "arrow,dma-channels", &nr);
+	nr = clamp_t(u32, nr, 1, SDMA_MAX_CHANNELS);
+
+	dma_cap_zero(dma_m2m_mask);
+	dma_cap_set(DMA_MEMCPY, dma_m2m_mask);
+
+	while (dma_priv->nr_chans < nr) {
+		chan = dma_request_channel(dma_m2m_mask,
+					   dma_dev ? sdma_chan_filter : NULL,
+					   dma_dev);
+		if (!chan)
+			break;
+
+		dma_priv->chans[dma_priv->nr_chans++].chan = chan;
+		if (!dma_dev) {
+			dma_priv->dma_m2m_chan = chan;
+			dma_dev = chan->device;
+		}
+	}
+
+	if (!dma_priv->nr_chans) {
+		dev_err(dma_priv->dev,
+			"Error opening the SDMA memory to memory channel\n");
+		return -EINVAL;
+	}
+
+	dev_info(dma_priv->dev, "using %u memcpy channel(s)\n",
+		 dma_priv->nr_chans);
+
+	return 0;
+}
+
 static int my_probe(struct platform_device *pdev)
 {
 	int retval;
 	struct dma_private *dma_device;
-	dma_cap_mask_t dma_m2m_mask;
 
 	dev_info(&pdev->dev, "platform_probe enter\n");
 
@@ -109,39 +2587,58 @@ static int my_probe(struct platform_device *pdev)
 	dma_device->dma_misc_device.minor = MISC_DYNAMIC_MINOR;
 	dma_device->dma_misc_device.name = "sdma_test";
 	dma_device->dma_misc_device.fops = &dma_fops;
+	dma_device->dma_misc_device.groups = sdma_groups;
 
 	dma_device->dev = &pdev->dev;
 
-	dma_device->wbuf = devm_kzalloc(&pdev->dev, SDMA_BUF_SIZE, GFP_KERNEL);
-	if (!dma_device->wbuf) {
-		dev_err(&pdev->dev, "error allocating wbuf !!\n");
-		return -ENOMEM;
-	}
+	atomic_set(&dma_device->nr_ctx, 0);
+	init_waitqueue_head(&dma_device->wq_ctx);
+	spin_lock_init(&dma_device->pool_lock);
+	INIT_LIST_HEAD(&dma_device->pool_free);
+	init_waitqueue_head(&dma_device->wq_pool);
 
-	dma_device->rbuf = devm_kzalloc(&pdev->dev, SDMA_BUF_SIZE, GFP_KERNEL);
-	if (!dma_device->rbuf) {
-		dev_err(&pdev->dev, "error allocating rbuf !!\n");
-		return -ENOMEM;
-	}
+	retval = sdma_request_channels(dma_device);
+	if (retval)
+		return retval;
 
-	dma_cap_zero(dma_m2m_mask);
-	dma_cap_set(DMA_MEMCPY, dma_m2m_mask);
-	dma_device->dma_m2m_chan = dma_request_channel(dma_m2m_mask, 0, NULL);
-	if (!dma_device->dma_m2m_chan) {
-		dev_err(&pdev->dev,
-			"Error opening the SDMA memory to memory channel\n");
-		return -EINVAL;
-	}
+	/* Largest single descriptor, kept a multiple of the copy alignment */
+	dma_device->copy_align =
+		1 << dma_device->dma_m2m_chan->device->copy_align;
+	dma_device->fill_align =
+		1 << dma_device->dma_m2m_chan->device->fill_align;
+	dma_device->has_memset =
+		dma_has_cap(DMA_MEMSET,
+			    dma_device->dma_m2m_chan->device->cap_mask);
+	dma_device->max_chunk = ALIGN_DOWN(
+		dma_get_max_seg_size(
+			dmaengine_get_dma_device(dma_device->dma_m2m_chan)),
+		dma_device->copy_align);
+
+	retval = sdma_pool_create(dma_device);
+	if (retval)
+		goto err_chan;
+
+	retval = sdma_mmap_init(dma_device);
+	if (retval)
+		goto err_pool;
+
+	sdma_calibrate(dma_device);
 
 	retval = misc_register(&dma_device->dma_misc_device);
 	if (retval)
-		return retval;
+		goto err_pool;
 
 	platform_set_drvdata(pdev, dma_device);
 
 	dev_info(&pdev->dev, "platform_probe exit\n");
 
 	return 0;
+
+err_pool:
+	sdma_pool_destroy(dma_device);
+err_chan:
+	sdma_release_channels(dma_device);
+	return retval;
 }
 
 static int my_remove(struct platform_device *pdev)
@@ -149,7 +2646,12 @@ static int my_remove(struct platform_device *pdev)
 	struct dma_private *dma_device = platform_get_drvdata(pdev);
 	dev_info(&pdev->dev, "platform_remove enter\n");
 	misc_deregister(&dma_device->dma_misc_device);
-	dma_release_channel(dma_device->dma_m2m_chan);
+
+	/* Files still open keep using the channels, wait for them to close */
+	wait_event(dma_device->wq_ctx, !atomic_read(&dma_device->nr_ctx));
+
+	sdma_pool_destroy(dma_device);
+	sdma_release_channels(dma_device);
 	dev_info(&pdev->dev, "platform_remove exit\n");
 	return 0;
 }
@@ -195,5 +2697,6 @@ module_init(demo_init);
 module_exit(demo_exit);
 
 MODULE_LICENSE("GPL");
+MODULE_IMPORT_NS(DMA_BUF);
 MODULE_AUTHOR("Alberto Liberal <aliberal@arroweurope.com>");
 MODULE_DESCRIPTION("This is a SDMA memory to memory driver");
@@ -0,0 +1,191 @@
+#ifndef SDMA_M2M_H
+#define SDMA_M2M_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Zero-copy transfer request. src and dst are user space addresses, the
+ * driver pins both ranges and lets the DMA engine copy between them directly.
+ */
+struct sdma_copy {
+	__u64 src;
+	__u64 dst;
+	__u64 len;
+};
+
+/*
+ * Asynchronous transfer request. The copy is queued on the DMA channel and
+ * the ioctl returns at once with cookie filled in. The outcome is collected
+ * later through SDMA_IOC_REAP. Every open file has its own completion ring
+ * and cookie sequence.
+ */
+struct sdma_submit {
+	__u64 src;
+	__u64 dst;
+	__u64 len;
+	__u64 user_data; /* handed back untouched in the completion */
+	__u64 cookie; /* out */
+};
+
+/* One entry of the completion ring */
+struct sdma_completion {
+	__u64 cookie;
+	__u64 user_data;
+	__s32 status; /* 0 or a negative errno */
+	__u32 reserved;
+};
+
+/*
+ * Reap up to count completions into the entries array. The call blocks until
+ * at least min_complete of them are available, count is updated with the
+ * number of entries written.
+ */
+struct sdma_reap {
+	__u64 entries;
+	__u32 count;
+	__u32 min_complete;
+};
+
+/* One copy of a batch, status is written back by the driver */
+struct sdma_job {
+	__u64 src;
+	__u64 dst;
+	__u64 len;
+	__s32 status;
+	__u32 reserved;
+};
+
+/* Block until every job of the batch has finished */
+#define SDMA_BATCH_WAIT (1 << 0)
+/*
+ * Post one completion per job instead of one for the whole batch, ignored
+ * together with SDMA_BATCH_WAIT
+ */
+#define SDMA_BATCH_PER_JOB (1 << 1)
+
+#define SDMA_BATCH_MAX_JOBS 16384
+
+/*
+ * Queue count jobs on the channel and start them with a single issue. Each
+ * job's status tells whether it was queued (or, with SDMA_BATCH_WAIT, how it
+ * finished). Without SDMA_BATCH_WAIT the batch completes through the reap
+ * ring: cookie identifies the batch entry, or the first job when
+ * SDMA_BATCH_PER_JOB is set, in which case job i completes as cookie + i.
+ */
+struct sdma_batch {
+	__u64 jobs;
+	__u32 count;
+	__u32 flags;
+	__u64 user_data;
+	__u64 cookie; /* out */
+};
+
+/* Complete through the reap ring instead of blocking */
+#define SDMA_KICK_ASYNC (1 << 0)
+
+/*
+ * Copy len bytes from src_off to dst_off inside the coherent buffer that
+ * mmap() on the file exposes. The two ranges must not overlap. Each open
+ * file gets its own buffer on its first mmap(), before that the ioctl fails
+ * with ENXIO.
+ */
+struct sdma_kick {
+	__u64 src_off;
+	__u64 dst_off;
+	__u64 len;
+	__u64 user_data;
+	__u64 cookie; /* out, with SDMA_KICK_ASYNC */
+	__u32 flags;
+	__u32 reserved;
+};
+
+/*
+ * Allocate a buffer of size bytes and hand it out as a dma-buf. The ioctl
+ * returns the new file descriptor, which other drivers can import and user
+ * space can mmap().
+ */
+struct sdma_export {
+	__u64 size;
+	__u32 flags; /* must be 0 */
+	__u32 reserved;
+};
+
+/* Complete through the reap ring instead of blocking */
+#define SDMA_DMABUF_ASYNC (1 << 0)
+
+/*
+ * Copy len bytes between two dma-bufs. src and dst are offsets into the
+ * buffers behind src_fd and dst_fd. A side whose fd is negative is a user
+ * space address instead, pinned as for SDMA_IOC_COPY.
+ */
+struct sdma_dmabuf_copy {
+	__s32 src_fd;
+	__s32 dst_fd;
+	__u64 src;
+	__u64 dst;
+	__u64 len;
+	__u64 user_data;
+	__u64 cookie; /* out, with SDMA_DMABUF_ASYNC */
+	__u32 flags;
+	__u32 reserved;
+};
+
+/* Complete through the reap ring instead of blocking */
+#define SDMA_FILL_ASYNC (1 << 0)
+
+/*
+ * Set len bytes at the user space address dst to the low byte of value.
+ * Uses the engine's memset when the channel has one, the CPU otherwise.
+ */
+struct sdma_fill {
+	__u64 dst;
+	__u64 len;
+	__u64 user_data;
+	__u64 cookie; /* out, with SDMA_FILL_ASYNC */
+	__u32 value;
+	__u32 flags;
+};
+
+/* One user space range of an SG copy */
+struct sdma_iovec {
+	__u64 base;
+	__u64 len;
+};
+
+/* Complete through the reap ring instead of blocking */
+#define SDMA_SG_ASYNC (1 << 0)
+/* Copy buf out over the vector instead of gathering the vector into buf */
+#define SDMA_SG_SCATTER (1 << 1)
+
+#define SDMA_SG_MAX_IOV 1024
+
+/*
+ * Gather the nr_iov ranges of the iov array, in order, into the contiguous
+ * buffer at buf, or with SDMA_SG_SCATTER scatter buf over them. buf is as
+ * long as all ranges together.
+ */
+struct sdma_sg_copy {
+	__u64 iov;
+	__u64 buf;
+	__u64 user_data;
+	__u64 cookie; /* out, with SDMA_SG_ASYNC */
+	__u32 nr_iov;
+	__u32 flags;
+};
+
+#define SDMA_IOC_MAGIC 'S'
+
+#define SDMA_IOC_COPY _IOW(SDMA_IOC_MAGIC, 0, struct sdma_copy)
+#define SDMA_IOC_SUBMIT _IOWR(SDMA_IOC_MAGIC, 1, struct sdma_submit)
+#define SDMA_IOC_REAP _IOWR(SDMA_IOC_MAGIC, 2, struct sdma_reap)
+#define SDMA_IOC_BATCH _IOWR(SDMA_IOC_MAGIC, 3, struct sdma_batch)
+#define SDMA_IOC_KICK _IOWR(SDMA_IOC_MAGIC, 4, struct sdma_kick)
+/* Size in bytes of the mmap() buffer */
+#define SDMA_IOC_MMAP_SIZE _IOR(SDMA_IOC_MAGIC, 5, __u64)
+#define SDMA_IOC_EXPORT _IOW(SDMA_IOC_MAGIC, 6, struct sdma_export)
+#define SDMA_IOC_DMABUF_COPY _IOWR(SDMA_IOC_MAGIC, 7, struct sdma_dmabuf_copy)
+#define SDMA_IOC_FILL _IOWR(SDMA_IOC_MAGIC, 8, struct sdma_fill)
+#define SDMA_IOC_SG_COPY _IOWR(SDMA_IOC_MAGIC, 9, struct sdma_sg_copy)
+
+#endif /* SDMA_M2M_H */